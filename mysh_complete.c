@@ -335,25 +335,71 @@
 #include <ctype.h>
 #include <termios.h>
 #include <signal.h>
+#include <time.h>
 #include <glob.h>
 #include <pwd.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <limits.h>
 
 #define MAX_LINE 4096
-#define MAX_ARGS 128
-#define MAX_CMDS 64
-#define MAX_REDIRECTS 16
-#define MAX_JOBS 64
+#define PROC_HASH_BUCKETS 1024
 #define MAX_VARS 256
 
-/* Job states */
+/* Job states (also used per process) */
 typedef enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE } job_state_t;
 
+struct job;
+
+/* One process of a job: every pipeline member, not just the leader */
+typedef struct proc {
+    pid_t pid;
+    int pidfd;             /* -1 once reaped (or if pidfd_open failed) */
+    job_state_t state;
+    int status;            /* Exit code, or 128 + signal */
+    char *name;            /* argv[0], kept for `time` only */
+    struct timespec start; /* Launched (CLOCK_MONOTONIC) */
+    struct timespec end;   /* Reaped */
+    struct rusage ru;      /* From waitid() at exit */
+    struct job *job;
+    struct proc *hnext;    /* pid hash chain */
+} proc_t;
+
 /* Job structure for job control */
-typedef struct {
+typedef struct job {
     int id;
     pid_t pgid;
     job_state_t state;
     char *command;
+    proc_t *procs;
+    int nprocs;
+    int nrunning;
+    int nstopped;
+    int background;
+    int notify;            /* State change not yet reported */
+    int cgfd;              /* cgroup leaf (set -o cgroups), or -1 */
+    unsigned cgseq;        /* Its name: job<cgseq> */
+    struct job *cprev;     /* Changed list (see job_changed()) */
+    struct job *cnext;
+    int changed;           /* On the changed list */
+    int timed;             /* `time` prefix: report when done */
+    struct timespec start;
+    struct rusage shell_ru; /* Shell's own usage at start */
 } job_t;
 
 /* Variable storage */
@@ -371,38 +417,184 @@ typedef struct {
     mode_t mode;
 } redirect_t;
 
-/* Command in pipeline */
+/* Command in pipeline: args and redirects point into its pipeline's pools */
 typedef struct {
-    char *args[MAX_ARGS];
+    char **args;           /* argc words, then NULL */
     int argc;
-    redirect_t redirects[MAX_REDIRECTS];
+    redirect_t *redirects;
     int nredirects;
+    const struct pl_op *subshell;  /* ( list ): argc 0, run by a child shell */
 } command_t;
 
-/* Pipeline (job) */
+/*
+ * Pipeline (job), as expand_pipeline() lays it out in one piece,
+ * sized to the command - nothing fixed, no limits:
+ * 
+ *   cmds → [ cmd 0 | cmd 1 ]
+ *          [ ls -l NULL | wc -l NULL ]      argv pool
+ *          [ 1>out ]                        redirections
+ * 
+ * Each command's args is a slice of the pool (NULL-terminated, ready
+ * for execv()), its redirects a slice of the redirections: walking a
+ * pipeline reads memory front to back.
+ */
 typedef struct {
-    command_t cmds[MAX_CMDS];
+    command_t *cmds;
     int ncmds;
     int negate;
     int background;
+    int timed;             /* time prefix */
 } pipeline_t;
 
+/* Lexer output: spans over the input text, nothing copied */
+typedef enum {
+    TK_WORD,
+    TK_PIPE,               /* |  */
+    TK_OR_IF,              /* || */
+    TK_AMP,                /* &  */
+    TK_AND_IF,             /* && */
+    TK_SEMI,               /* ;  */
+    TK_LESS,               /* <  */
+    TK_DLESS,              /* << */
+    TK_GREAT,              /* >  */
+    TK_DGREAT,             /* >> */
+    TK_LPAREN,             /* (  */
+    TK_RPAREN,             /* )  */
+    TK_NEWLINE             /* unquoted \n: ends a line's tokens */
+} tok_kind_t;
+
+/* token_t.quote: which quoting a TK_WORD contains (0: text is the word) */
+#define TQ_SINGLE    1     /* '...' */
+#define TQ_DOUBLE    2     /* "..." */
+#define TQ_BACKSLASH 4     /* \c outside '...' */
+
+typedef struct {
+    size_t off;            /* Into the lexed text */
+    size_t len;
+    unsigned char kind;    /* tok_kind_t */
+    unsigned char quote;   /* TQ_* */
+} token_t;
+
+typedef struct {
+    token_t *v;            /* Reused line after line: grows, never shrinks */
+    int n;
+    int cap;
+} token_vec_t;
+
+/* Pipeline before expansion: what the parser decided, per token */
+typedef enum {
+    OP_WORD, OP_ASSIGN, OP_PIPE, OP_IN, OP_OUT, OP_APPEND, OP_SUBSHELL
+} op_kind_t;
+
+struct node;
+
+typedef struct pl_op {
+    op_kind_t kind;
+    const char *word;      /* Token span (redirects: the file); OP_PIPE: "|" */
+    size_t len;            /* OP_SUBSHELL: the "( ... )" text, for `jobs` */
+    int quote;             /* token_t.quote */
+    struct node *body;     /* OP_SUBSHELL: the list inside ( ) */
+} pl_op_t;
+
+typedef struct {
+    pl_op_t *ops;
+    int nops;
+    int negate;
+    int background;
+    int timed;
+} pl_code_t;
+
+/*
+ * Parsed command line: a tree of these, words still unexpanded spans.
+ * 
+ *   a && b | c; (d || e) &
+ * 
+ *   AND ──left──  PIPELINE a
+ *    │  ──right── PIPELINE b | c
+ *    next
+ *    ↓
+ *   PIPELINE (SUBSHELL: OR(d, e)), background
+ */
+typedef enum { ND_PIPELINE, ND_AND, ND_OR } node_kind_t;
+
+typedef struct node {
+    node_kind_t kind;
+    pl_code_t code;        /* ND_PIPELINE */
+    struct node *left;     /* ND_AND / ND_OR: run right if left */
+    struct node *right;    /* succeeded / failed */
+    struct node *next;     /* Next in its list (; & newline) */
+} node_t;
+
 /* Global state */
 static int last_status = 0;
 static pid_t shell_pgid;
 static int shell_terminal;
 static int interactive = 0;
 static struct termios shell_tmodes;
-static job_t jobs[MAX_JOBS];
-static int njobs = 0;
+static job_t **jobs;           /* jobs[id - 1], NULL = free slot */
+static int njobs = 0;          /* Highest job id in use */
+static int jobs_cap = 0;
+static int nrunning_jobs = 0;  /* Jobs in state JOB_RUNNING */
+static job_t *changed_head;    /* Jobs with unreported state changes, */
+static job_t *changed_tail;    /* oldest first */
+static proc_t *proc_hash[PROC_HASH_BUCKETS];
+static int event_fd = -1;      /* epoll: pidfds, signals, stdin, timer */
+static int signal_fd = -1;     /* signalfd: SIGCHLD, SIGWINCH */
+static int timer_fd = -1;      /* timerfd: $TMOUT */
+static int timer_armed = 0;
+static int stdin_pollable = 0; /* 0: regular file, read() directly */
+static int stdin_ready = 0;
+static char ev_signal, ev_stdin, ev_timer;  /* epoll_data.ptr tags */
+static int sigint_seen = 0;    /* ^C while catch_sigint(1) */
+static int nlegacy_procs = 0;  /* Tracked without a pidfd */
 static var_t vars[MAX_VARS];
 static int nvars = 0;
 static pid_t last_bg_pid = 0;
+static char **pos_args;        /* $0 $1 ...: mysh [-c cmd] name args */
+static int npos_args;
+
+/* Pipeline stages running on shell threads (see stage_thread_start()) */
+typedef struct {
+    pthread_t tid;
+    job_t *job;
+    int job_id;            /* job is only looked at while it's still this */
+} stage_thread_t;
+
+static stage_thread_t *stage_threads;
+static int nstage_threads, stage_threads_cap;
+static pid_t stage_threads_pid;    /* Forked children have none of them */
+
+/* Shell options (set -o NAME / set +o NAME) */
+static int opt_zygote = 0;
+static int opt_cgroups = 0;
+
+/* Zygote launcher (set -o zygote) */
+static pid_t zygote_pid = 0;
+static int zygote_sock = -1;
+static pid_t zygote_shell_pid;
+
+/* Set while a pipeline's builtin stage runs in the shell itself */
+static int builtin_in_pipeline;
+
+/* Set in the child running a ( list ): its jobs join its process group */
+static int in_subshell;
 
 /* Forward declarations */
-static void init_shell(void);
+static void init_shell(int script);
 static int execute_pipeline(pipeline_t *pl);
-static char *expand_word(const char *word);
+static char *expand_word(const char *word, size_t len, int quote, char **pattern);
+static void path_cache_clear(void);
+static void input_timeout(void);
+static int zygote_start(void);
+static void zygote_stop(void);
+static int is_builtin(const char *cmd);
+static int lex(const char *text, size_t *pos, size_t len, token_vec_t *tv);
+static int run_list(const node_t *n);
+static int expand_pipeline(const pl_code_t *code, pipeline_t *pl);
+static pid_t spawn_stage(pipeline_t *pl, int i, pid_t pgid, int pipes[][2],
+                         const char *path);
+static void exec_stage(pipeline_t *pl, int i, pid_t pgid, int pipes[][2],
+                       const char *path);
 
 /* Error handling */
 static void die(const char *msg) {
@@ -410,6 +602,115 @@ static void die(const char *msg) {
     exit(1);
 }
 
+/*
+ * ARENA - BUMP ALLOCATION FOR A COMMAND'S SHORT-LIVED DATA
+ * 
+ * A command line allocates many small things that all die together:
+ * parse tree nodes and ops, then on every run its expanded words,
+ * glob matches, redirection targets and the argv/redirection pools. One
+ * malloc()/free() each is most of the allocator traffic of a shell.
+ * 
+ * Instead they are carved out of big blocks by moving a pointer:
+ * 
+ *   block 1 [ node node ops | word word argv |       free      ]
+ *                                            ^used
+ *   arena_mark() remembers (block, used); arena_release() puts them
+ *   back: everything allocated since is gone in O(1), no free()s.
+ *   arena_reset() is a release to the very start.
+ * 
+ * Blocks are never given back by a release or reset, only reused, so
+ * once an arena has grown to the largest command's needs it stops
+ * calling malloc() at all: memory stays flat however many commands
+ * run. Blocks start at ARENA_BLOCK and double with each new one (a
+ * bigger request gets a block its size), up to ARENA_BLOCK_MAX.
+ * 
+ * Users:
+ *   script_t.arena   a script's (or the REPL line's) parse trees,
+ *                    reset when the line is done / freed with the script
+ *   run_arena        expansion of the pipeline being run, marked and
+ *                    released around it by run_node() - nested runs
+ *                    (source, subshells) stack up and unwind in order
+ */
+#define ARENA_BLOCK     4096
+#define ARENA_BLOCK_MAX (1024 * 1024)
+#define ARENA_ALIGN     16         /* malloc()'s: any type fits */
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;           /* Usable bytes in data[] */
+    unsigned char data[];  /* At offset 16: ARENA_ALIGNed as malloc() is */
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *first;
+    arena_block_t *cur;    /* NULL: nothing allocated (reset) */
+    size_t used;           /* Bytes of cur->data taken */
+    size_t next_size;
+} arena_t;
+
+typedef struct {
+    arena_block_t *block;
+    size_t used;
+} arena_mark_t;
+
+static arena_t run_arena;
+
+static void *arena_alloc(arena_t *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!a->cur || a->used + n > a->cur->size) {
+        /* Next kept block, unless it's too small for this */
+        arena_block_t *b = a->cur ? a->cur->next : a->first;
+        if (!b || b->size < n) {
+            size_t size = a->next_size ? a->next_size : ARENA_BLOCK;
+            if (size < n) size = n;
+            if (a->next_size < ARENA_BLOCK_MAX) a->next_size = size * 2;
+            arena_block_t *nb = malloc(sizeof(*nb) + size);
+            if (!nb) die("malloc");
+            nb->size = size;
+            nb->next = b;
+            if (a->cur) a->cur->next = nb;
+            else a->first = nb;
+            b = nb;
+        }
+        a->cur = b;
+        a->used = 0;
+    }
+    void *p = a->cur->data + a->used;
+    a->used += n;
+    return p;
+}
+
+static char *arena_strndup(arena_t *a, const char *s, size_t n) {
+    char *d = arena_alloc(a, n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+static arena_mark_t arena_mark(arena_t *a) {
+    arena_mark_t m = { a->cur, a->used };
+    return m;
+}
+
+static void arena_release(arena_t *a, arena_mark_t m) {
+    a->cur = m.block;
+    a->used = m.used;
+}
+
+static void arena_reset(arena_t *a) {
+    a->cur = NULL;
+    a->used = 0;
+}
+
+static void arena_free(arena_t *a) {
+    while (a->first) {
+        arena_block_t *next = a->first->next;
+        free(a->first);
+        a->first = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
 /*
  * VARIABLE MANAGEMENT - ENVIRONMENT PASSING MECHANISM
  * 
@@ -454,8 +755,15 @@ static var_t *find_var(const char *name) {
 static void set_var(const char *name, const char *value, int exported) {
     var_t *v = find_var(name);
     if (v) {
-        free(v->value);
-        v->value = strdup(value);
+        /* In place if it fits: a flag or counter set over and over
+         * doesn't allocate each time */
+        size_t n = strlen(value);
+        if (n <= strlen(v->value)) {
+            memmove(v->value, value, n + 1);
+        } else {
+            free(v->value);
+            v->value = strdup(value);
+        }
         if (exported) v->exported = 1;
     } else if (nvars < MAX_VARS) {
         vars[nvars].name = strdup(name);
@@ -467,6 +775,8 @@ static void set_var(const char *name, const char *value, int exported) {
     if (exported) {
         setenv(name, value, 1);
     }
+    
+    if (strcmp(name, "PATH") == 0) path_cache_clear();
 }
 
 static const char *get_var(const char *name) {
@@ -485,6 +795,35 @@ static const char *get_var(const char *name) {
         return buf;
     }
     
+    /* Positional parameters: $0..$9, ${10}, $# and $@ / $*, the
+     * latter as one word (there is no field splitting) */
+    if (isdigit((unsigned char)name[0])) {
+        int n = atoi(name);
+        return n < npos_args ? pos_args[n] : NULL;
+    }
+    if (strcmp(name, "#") == 0) {
+        snprintf(buf, sizeof(buf), "%d", npos_args > 0 ? npos_args - 1 : 0);
+        return buf;
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0) {
+        static char *all;
+        static size_t all_cap;
+        size_t len = 1;
+        for (int i = 1; i < npos_args; i++) len += strlen(pos_args[i]) + 1;
+        if (len > all_cap) {
+            all_cap = len;
+            all = realloc(all, all_cap);
+            if (!all) die("realloc");
+        }
+        char *out = all;
+        for (int i = 1; i < npos_args; i++) {
+            out = stpcpy(out, pos_args[i]);
+            if (i < npos_args - 1) *out++ = ' ';
+        }
+        *out = '\0';
+        return all;
+    }
+    
     var_t *v = find_var(name);
     if (v) return v->value;
     return getenv(name);
@@ -624,37 +963,478 @@ static const char *get_var(const char *name) {
  *   - Must isolate shell, manage foreground/background
  */
 
-static void add_job(pid_t pgid, const char *cmd, int background) {
-    if (njobs >= MAX_JOBS) return;
-    jobs[njobs].id = njobs + 1;
-    jobs[njobs].pgid = pgid;
-    jobs[njobs].state = JOB_RUNNING;
-    jobs[njobs].command = strdup(cmd);
-    njobs++;
+/*
+ * CGROUPS - PER-JOB CONTAINMENT (set -o cgroups)
+ * 
+ * With the option on, every job gets its own cgroup v2 leaf, so a
+ * runaway `sort &` can be capped (jobs limit) and measured (jobs -l)
+ * without touching the shell or the other jobs:
+ * 
+ *   <base>/                 $MYSH_CGROUP, else the shell's own cgroup
+ *   └── mysh.<pid>/         subtree_control: +cpu +memory +io
+ *       ├── shell/          the shell itself (if base was its own)
+ *       ├── job1/           one leaf per job (a counter, not the %id)
+ *       └── job2/
+ * 
+ * cgroup v2 rules that shape this:
+ *   - No internal processes: a cgroup handing controllers down
+ *     (cgroup.subtree_control) may not hold processes itself, so the
+ *     shell first moves out of base into shell/.
+ *   - Moving a process takes write access to cgroup.procs of the
+ *     common ancestor: all of it stays under base, which must be
+ *     delegated to the user (systemd-run --user --scope -p Delegate=yes).
+ *   - Writing "0" to cgroup.procs moves the writer itself.
+ * 
+ * Children join in the child, before exec: the vfork and fork paths
+ * write "0" to the job's cgroup.procs (spawn_cgroup), so not even a
+ * grandchild forked right away escapes. posix_spawn() has no hook for
+ * that and zygote children are forked elsewhere; both are bypassed
+ * for such jobs.
+ * 
+ * Degrades instead of failing: without a cgroup2 mount or a writable
+ * base, `set -o cgroups` is refused; a controller base doesn't offer
+ * only makes its limit fail; a leaf that can't be created leaves the
+ * job uncontained. The leaf is removed with the job.
+ */
+static int cg_base = -1;        /* base/ */
+static int cg_root = -1;        /* base/mysh.<pid>/ */
+static int cg_moved = 0;        /* The shell moved into shell/ */
+static unsigned cg_seq = 0;
+static char cg_name[32];        /* "mysh.<pid>" */
+static int spawn_cgroup = -1;   /* cgroup.procs of the job being launched */
+
+static int cg_write(int dirfd, const char *file, const char *val) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, val, strlen(val));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n < 0 ? -1 : 0;
+}
+
+static int cg_read(int dirfd, const char *file, char *buf, size_t size) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* Value of "key N" in a flat-keyed file (cpu.stat), -1 if absent */
+static long long cg_key(const char *buf, const char *key) {
+    size_t len = strlen(key);
+    for (const char *p = buf; p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL) {
+        if (strncmp(p, key, len) == 0 && p[len] == ' ') return atoll(p + len + 1);
+    }
+    return -1;
+}
+
+/* Where base is: $MYSH_CGROUP, or cgroup2 mount + "0::" path */
+static int cg_open_base(void) {
+    const char *env = get_var("MYSH_CGROUP");
+    if (env && *env) return open(env, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    
+    char line[1024], mnt[256] = "", rel[768] = "";
+    /* Unified: /sys/fs/cgroup; hybrid: usually /sys/fs/cgroup/unified */
+    FILE *f = fopen("/proc/self/mountinfo", "re");
+    while (f && !mnt[0] && fgets(line, sizeof(line), f)) {
+        if (strstr(line, " - cgroup2 ")) sscanf(line, "%*s %*s %*s %*s %255s", mnt);
+    }
+    if (f) fclose(f);
+    f = fopen("/proc/self/cgroup", "re");
+    while (f && !rel[0] && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) sscanf(line + 3, "%767s", rel);
+    }
+    if (f) fclose(f);
+    if (!mnt[0] || !rel[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+    
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", mnt, rel);
+    cg_moved = -1;              /* Own cgroup: the shell must leave it */
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void cg_stop(void) {
+    if (cg_root < 0) return;
+    if (cg_moved > 0 && cg_write(cg_base, "cgroup.procs", "0") == 0) {
+        unlinkat(cg_root, "shell", AT_REMOVEDIR);
+        cg_moved = 0;
+    }
+    /* Fails while jobs keep their leaves; the last one retries */
+    unlinkat(cg_base, cg_name, AT_REMOVEDIR);
+}
+
+static int cg_start(void) {
+    static int registered;
+    if (cg_root >= 0) {          /* Again after set +o: same tree */
+        close(cg_root);
+        close(cg_base);
+    }
+    /* On exit, step back into base so shell/ and mysh.<pid> can go */
+    if (!registered++) atexit(cg_stop);
+    cg_moved = 0;
+    cg_base = cg_open_base();
+    if (cg_base < 0) return -1;
+    
+    snprintf(cg_name, sizeof(cg_name), "mysh.%d", (int)getpid());
+    if (mkdirat(cg_base, cg_name, 0755) < 0 && errno != EEXIST) goto fail;
+    cg_root = openat(cg_base, cg_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg_root < 0) goto fail;
+    
+    if (cg_moved < 0) {
+        cg_moved = 0;
+        if ((mkdirat(cg_root, "shell", 0755) < 0 && errno != EEXIST) ||
+            cg_write(cg_root, "shell/cgroup.procs", "0") < 0) goto fail;
+        cg_moved = 1;
+    }
+    
+    /* Hand down what base offers. EBUSY (base still has other
+     * processes) or a missing controller only disables that limit;
+     * cpu.stat accounting works without any controller. */
+    char avail[256];
+    if (cg_read(cg_base, "cgroup.controllers", avail, sizeof(avail)) == 0) {
+        static const char *const ctl[] = { "cpu", "memory", "io" };
+        for (int i = 0; i < 3; i++) {
+            char *p = strstr(avail, ctl[i]);
+            size_t len = strlen(ctl[i]);
+            if (!p || (p > avail && p[-1] != ' ') || (p[len] && !isspace(p[len]))) continue;
+            char plus[16];
+            snprintf(plus, sizeof(plus), "+%s", ctl[i]);
+            if (cg_write(cg_base, "cgroup.subtree_control", plus) == 0) {
+                cg_write(cg_root, "cgroup.subtree_control", plus);
+            }
+        }
+    }
+    return 0;
+    
+fail:;
+    int err = errno;
+    if (cg_root >= 0) {
+        unlinkat(cg_root, "shell", AT_REMOVEDIR);
+        close(cg_root);
+    }
+    unlinkat(cg_base, cg_name, AT_REMOVEDIR);
+    close(cg_base);
+    cg_root = cg_base = -1;
+    errno = err;
+    return -1;
+}
+
+/* New job's leaf: directory fd, or -1 (uncontained) */
+static int cg_job_create(unsigned *seq) {
+    if (!opt_cgroups || cg_root < 0) return -1;
+    
+    char name[16];
+    *seq = ++cg_seq;
+    snprintf(name, sizeof(name), "job%u", *seq);
+    if (mkdirat(cg_root, name, 0755) < 0) return -1;
+    int fd = openat(cg_root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) unlinkat(cg_root, name, AT_REMOVEDIR);
+    return fd;
+}
+
+static void cg_job_remove(int fd, unsigned seq) {
+    char name[16];
+    snprintf(name, sizeof(name), "job%u", seq);
+    close(fd);
+    /* EBUSY: something escaped the process group and lives on */
+    unlinkat(cg_root, name, AT_REMOVEDIR);
+    if (!opt_cgroups) unlinkat(cg_base, cg_name, AT_REMOVEDIR);
+}
+
+/*
+ * JOB TABLE
+ * 
+ * jobs[id - 1] → job_t (NULL = free slot). New jobs get id = highest+1,
+ * so lookups by %id are O(1) and ids never shift when a job finishes.
+ * 
+ * Every process of a pipeline is tracked (not just the group leader),
+ * each with its own pidfd. A pid → proc_t hash serves the SIGCHLD path
+ * (stop/continue reports carry only a pid) and `wait PID`; finished
+ * procs stay in it until their job is removed.
+ */
+static job_t *find_job(int id) {
+    if (id < 1 || id > njobs) return NULL;
+    return jobs[id - 1];
+}
+
+/*
+ * Job specs: %N (job N), %% %+ or % (current = newest), %- (the one
+ * before it), %name (command starts with name), %?text (contains it).
+ * Returns NULL if none or, for name/text, more than one matches.
+ */
+static job_t *job_from_spec(const char *spec) {
+    if (spec[0] != '%') return NULL;
+    spec++;
+    
+    if (*spec == '\0' || strcmp(spec, "%") == 0 || strcmp(spec, "+") == 0) {
+        return find_job(njobs);
+    }
+    if (strcmp(spec, "-") == 0) {
+        for (int id = njobs - 1; id >= 1; id--) {
+            if (find_job(id)) return find_job(id);
+        }
+        return NULL;
+    }
+    if (isdigit((unsigned char)*spec)) return find_job(atoi(spec));
     
-    if (background) {
-        printf("[%d] %d\n", njobs, pgid);
+    int contains = *spec == '?';
+    if (contains) spec++;
+    job_t *match = NULL;
+    for (int id = 1; id <= njobs; id++) {
+        job_t *job = find_job(id);
+        if (!job) continue;
+        if (contains ? !strstr(job->command, spec)
+                     : strncmp(job->command, spec, strlen(spec)) != 0) continue;
+        if (match) return NULL;  /* Ambiguous */
+        match = job;
     }
+    return match;
+}
+
+static job_t *add_job(const char *cmd, int maxprocs, int background) {
+    if (njobs == jobs_cap) {
+        jobs_cap = jobs_cap ? jobs_cap * 2 : 16;
+        jobs = realloc(jobs, jobs_cap * sizeof(*jobs));
+    }
+    
+    job_t *job = calloc(1, sizeof(*job));
+    job->id = njobs + 1;
+    job->state = JOB_RUNNING;
+    job->command = strdup(cmd);
+    job->procs = calloc(maxprocs, sizeof(proc_t));
+    job->background = background;
+    job->cgfd = cg_job_create(&job->cgseq);
+    jobs[njobs++] = job;
+    nrunning_jobs++;
+    return job;
 }
 
-static job_t *find_job(pid_t pgid) {
-    for (int i = 0; i < njobs; i++) {
-        if (jobs[i].pgid == pgid) return &jobs[i];
+static unsigned proc_hash_slot(pid_t pid) {
+    return (unsigned)pid % PROC_HASH_BUCKETS;
+}
+
+static proc_t *find_proc(pid_t pid) {
+    for (proc_t *p = proc_hash[proc_hash_slot(pid)]; p; p = p->hnext) {
+        if (p->pid == pid) return p;
     }
     return NULL;
 }
 
-static void remove_job(pid_t pgid) {
-    for (int i = 0; i < njobs; i++) {
-        if (jobs[i].pgid == pgid) {
-            free(jobs[i].command);
-            memmove(&jobs[i], &jobs[i+1], (njobs - i - 1) * sizeof(job_t));
-            njobs--;
+static void unhash_proc(proc_t *p) {
+    proc_t **pp = &proc_hash[proc_hash_slot(p->pid)];
+    for (; *pp; pp = &(*pp)->hnext) {
+        if (*pp == p) {
+            *pp = p->hnext;
             return;
         }
     }
 }
 
+/*
+ * Changed list - jobs whose state changed since it was last reported,
+ * oldest first (doubly linked: remove_job() unlinks in O(1)).
+ * notify_jobs() and `wait -n` walk this instead of the job table, so
+ * a completion costs O(1) however many jobs are outstanding.
+ */
+static void job_changed(job_t *job) {
+    if (job->changed) return;
+    job->changed = 1;
+    job->cprev = changed_tail;
+    job->cnext = NULL;
+    if (changed_tail) changed_tail->cnext = job;
+    else changed_head = job;
+    changed_tail = job;
+}
+
+static void job_unchanged(job_t *job) {
+    if (!job->changed) return;
+    job->changed = 0;
+    if (job->cprev) job->cprev->cnext = job->cnext;
+    else changed_head = job->cnext;
+    if (job->cnext) job->cnext->cprev = job->cprev;
+    else changed_tail = job->cprev;
+}
+
+/*
+ * Register a launched child with the job and the event loop.
+ * 
+ * pidfd_open(pid, 0) - syscall (Linux 5.3+)
+ * ------------------
+ * Returns an FD referring to the process itself (not its PID number):
+ *   - Becomes readable (EPOLLIN) when the process terminates
+ *   - waitid(P_PIDFD, fd, ...) reaps exactly that child
+ *   - No PID-reuse race: the FD pins the process identity
+ * No race at registration either: only this shell reaps its children,
+ * and it hasn't yet.
+ */
+static void job_add_proc(job_t *job, pid_t pid) {
+    proc_t *p = &job->procs[job->nprocs++];
+    p->pid = pid;
+    p->state = JOB_RUNNING;
+    p->job = job;
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    p->pidfd = pidfd_open(pid, 0);
+    job->nrunning++;
+    
+    if (p->pidfd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = p };
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, p->pidfd, &ev);
+    } else {
+        nlegacy_procs++;  /* Old kernel: reaped via SIGCHLD path */
+    }
+    
+    p->hnext = proc_hash[proc_hash_slot(pid)];
+    proc_hash[proc_hash_slot(pid)] = p;
+}
+
+/*
+ * time PIPELINE - PER-STAGE RESOURCE USAGE
+ * 
+ *   $ time yes | head -c 1G | gzip >/dev/null
+ *   stage            real     user      sys   maxrss    vcsw   ivcsw
+ *   yes             4.210    0.050    0.290     1.8M    7702      41
+ *   head            4.210    0.090    0.850     1.9M   15620      88
+ *   gzip            4.212    4.020    0.080     2.0M     201     390
+ *   (shell)             -    0.000    0.001     4.2M       3       0
+ *   total           4.213    4.160    1.221
+ * 
+ * struct rusage (getrusage(2), filled by waitid() at exit):
+ *   ru_utime / ru_stime  CPU time in user / kernel mode
+ *   ru_maxrss            Peak resident set, KiB
+ *   ru_nvcsw             Voluntary context switches: blocked (pipe
+ *                        empty/full, disk) - waiting on a neighbour
+ *   ru_nivcsw            Involuntary: preempted - CPU bound
+ * 
+ * Reading it: the stage whose user+sys is close to real is the
+ * bottleneck; its neighbours show real >> CPU and high vcsw.
+ * "real" per stage runs from launch to reap. The (shell) row is the
+ * shell's own CPU for launching and any builtin run in-process.
+ * Printed to stderr when the job is removed (foreground: on
+ * completion; background: when its "Done" is reported).
+ */
+static double ts_seconds(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static double tv_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void time_row(const char *name, double real, double user, double sys,
+                     long maxrss, long vcsw, long ivcsw) {
+    char rbuf[32], mbuf[32];
+    if (real < 0) snprintf(rbuf, sizeof(rbuf), "-");
+    else snprintf(rbuf, sizeof(rbuf), "%.3f", real);
+    if (maxrss >= 1024) snprintf(mbuf, sizeof(mbuf), "%.1fM", maxrss / 1024.0);
+    else snprintf(mbuf, sizeof(mbuf), "%ldK", maxrss);
+    fprintf(stderr, "%-12.12s %8s %8.3f %8.3f %8s %7ld %7ld\n",
+            name, rbuf, user, sys, mbuf, vcsw, ivcsw);
+}
+
+/* job may be NULL (builtin run in the shell) */
+static void time_report(job_t *job, const struct timespec *start,
+                        const struct rusage *shell_ru) {
+    struct timespec now;
+    struct rusage self;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &self);
+    
+    double user = tv_seconds(&self.ru_utime) - tv_seconds(&shell_ru->ru_utime);
+    double sys = tv_seconds(&self.ru_stime) - tv_seconds(&shell_ru->ru_stime);
+    
+    fprintf(stderr, "%-12s %8s %8s %8s %8s %7s %7s\n",
+            "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw");
+    for (int i = 0; job && i < job->nprocs; i++) {
+        proc_t *p = &job->procs[i];
+        const struct timespec *end = p->state == JOB_DONE ? &p->end : &now;
+        double u = tv_seconds(&p->ru.ru_utime), s = tv_seconds(&p->ru.ru_stime);
+        time_row(p->name ? p->name : "?", ts_seconds(&p->start, end), u, s,
+                 p->ru.ru_maxrss, p->ru.ru_nvcsw, p->ru.ru_nivcsw);
+        user += u;
+        sys += s;
+    }
+    time_row("(shell)", -1,
+             tv_seconds(&self.ru_utime) - tv_seconds(&shell_ru->ru_utime),
+             tv_seconds(&self.ru_stime) - tv_seconds(&shell_ru->ru_stime),
+             self.ru_maxrss, self.ru_nvcsw - shell_ru->ru_nvcsw,
+             self.ru_nivcsw - shell_ru->ru_nivcsw);
+    fprintf(stderr, "%-12s %8.3f %8.3f %8.3f\n", "total",
+            ts_seconds(start, &now), user, sys);
+}
+
+static void remove_job(job_t *job) {
+    if (job->timed) time_report(job, &job->start, &job->shell_ru);
+    
+    for (int i = 0; i < job->nprocs; i++) {
+        proc_t *p = &job->procs[i];
+        /* Finished procs stay hashed until here, for `wait PID`; once
+         * the job is gone that falls back to the bg_status ring */
+        unhash_proc(p);
+        free(p->name);
+        if (p->state == JOB_DONE) continue;
+        /* Still alive (shouldn't happen): stop tracking it */
+        if (p->pidfd >= 0) close(p->pidfd);
+        else nlegacy_procs--;
+    }
+    
+    if (job->state == JOB_RUNNING) nrunning_jobs--;
+    if (job->cgfd >= 0) cg_job_remove(job->cgfd, job->cgseq);
+    job_unchanged(job);
+    jobs[job->id - 1] = NULL;
+    while (njobs > 0 && !jobs[njobs - 1]) njobs--;
+    
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+/* Shell-style status of a finished job: last stage decides */
+static int job_status(job_t *job) {
+    return job->nprocs ? job->procs[job->nprocs - 1].status : 0;
+}
+
+/*
+ * Statuses of background processes whose job was reported and removed
+ * without a `wait`: POSIX lets `wait $!` collect them later. Kept for
+ * the last BG_STATUS_SIZE processes (a ring, so O(1) to record).
+ */
+#define BG_STATUS_SIZE 256
+
+static struct {
+    pid_t pid;
+    int status;
+} bg_status[BG_STATUS_SIZE];
+static unsigned bg_status_next;
+
+static void forget_job(job_t *job) {
+    for (int i = 0; job->background && i < job->nprocs; i++) {
+        bg_status[bg_status_next % BG_STATUS_SIZE].pid = job->procs[i].pid;
+        bg_status[bg_status_next % BG_STATUS_SIZE].status = job->procs[i].status;
+        bg_status_next++;
+    }
+    remove_job(job);
+}
+
+/* Newest first: a recycled pid finds its latest owner */
+static int bg_status_find(pid_t pid, int *status) {
+    for (unsigned n = 0; n < BG_STATUS_SIZE && n < bg_status_next; n++) {
+        unsigned slot = (bg_status_next - 1 - n) % BG_STATUS_SIZE;
+        if (bg_status[slot].pid == pid) {
+            *status = bg_status[slot].status;
+            bg_status[slot].pid = 0;   /* Collected once, like a zombie */
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /*
  * SIGNAL HANDLING - ASYNCHRONOUS EVENT NOTIFICATION
  * 
@@ -745,861 +1525,5178 @@ static void remove_job(pid_t pgid) {
  */
 
 /*
- * SIGCHLD HANDLER - REAPING ZOMBIE PROCESSES
+ * CHILD REAPING ENGINE - pidfd + signalfd + epoll (NO SIGCHLD HANDLER)
+ * 
+ * Old design: SIGCHLD handler calling waitpid(-1), printf(), and the
+ * job table code from signal context:
+ *   - printf()/malloc()/memmove() are NOT async-signal-safe
+ *   - Handler can interrupt the main code mid-update of jobs[]
+ *   - Matched pid against pgid → non-leader pipeline members lost
+ * 
+ * New design: all job-state changes happen in the main thread, inside
+ * reap_events(), driven by one epoll set (event_fd):
  * 
- * Zombie process: Terminated but not yet reaped (still in process table)
- * - Holds PID, exit status, resource usage
- * - Removed only when parent calls wait()
- * - If parent dies, init (PID 1) adopts and reaps
+ *   Source                    Reports              Reaped with
+ *   ------------------------  -------------------  -----------------------
+ *   pidfd per child           exit / kill          waitid(P_PIDFD, fd)
+ *   signalfd(SIGCHLD)         stop / continue      waitid(P_ALL, WSTOPPED|
+ *                                                         WCONTINUED)
  * 
- * waitpid() flags:
- *   WNOHANG: Return immediately if no child ready (non-blocking)
- *   WUNTRACED: Report stopped children (for ^Z handling)
- *   WCONTINUED: Report continued children (for fg/bg)
+ * epoll_data.ptr is the proc_t itself → O(1) per exit event, no scan
+ * of the job table no matter how many background jobs exist.
  * 
- * Why loop with WNOHANG:
- *   - Multiple children may have changed state
- *   - Signals are not queued (multiple SIGCHLDs may coalesce)
- *   - Must reap all ready children to avoid zombies
+ * SIGCHLD is BLOCKED in the shell (so it is never delivered as a
+ * signal) and read from the signalfd instead. Blocked signals are
+ * never discarded, even with default "ignore" disposition.
+ * Children get an empty signal mask (posix_spawn SETSIGMASK, or
+ * sigprocmask in the fork() path).
  * 
- * Race condition:
- *   Parent: fork() → ... → waitpid()
- *   Child:  ... → exit()
- *   SIGCHLD may arrive before parent reaches waitpid()
- *   Solution: Handler reaps, main code checks errno == ECHILD
+ * waitid() without WEXITED never reaps: stop/continue reports can be
+ * collected for ALL children without stealing exits from the pidfds.
+ * 
+ * siginfo_t decoding (waitid):
+ *   si_code CLD_EXITED:    si_status = exit code
+ *   si_code CLD_KILLED/DUMPED: si_status = signal number
+ *   si_code CLD_STOPPED:   si_status = stop signal (SIGTSTP, SIGTTIN...)
+ *   si_code CLD_CONTINUED: resumed by SIGCONT
  */
-static void sigchld_handler(int sig) {
-    (void)sig;
-    int status;
-    pid_t pid;
-    int saved_errno = errno;  /* Preserve errno across handler */
+static void job_refresh(job_t *job) {
+    job_state_t old = job->state;
     
-    /* Reap all dead children without blocking
-     * waitpid(-1, ...) waits for any child
-     * Returns: PID on success, 0 if WNOHANG and no child ready, -1 on error
-     */
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        job_t *job = find_job(pid);
-        if (!job) continue;
-        
-        /* Status decoding:
-         * WIFEXITED(s): (s & 0x7f) == 0
-         * WEXITSTATUS(s): (s >> 8) & 0xff
-         * WIFSIGNALED(s): ((s & 0x7f) + 1) >> 1 > 0
-         * WTERMSIG(s): s & 0x7f
-         * WIFSTOPPED(s): (s & 0xff) == 0x7f
-         * WSTOPSIG(s): (s >> 8) & 0xff
-         */
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            job->state = JOB_DONE;
-            /* Note: printf() is NOT async-signal-safe!
-             * In production, use write() with pre-formatted buffer */
-            printf("[%d] Done    %s\n", job->id, job->command);
-            remove_job(pid);
-        } else if (WIFSTOPPED(status)) {
-            job->state = JOB_STOPPED;
-            printf("[%d] Stopped %s\n", job->id, job->command);
-        } else if (WIFCONTINUED(status)) {
-            job->state = JOB_RUNNING;
-        }
+    if (job->nrunning > 0) job->state = JOB_RUNNING;
+    else if (job->nstopped > 0) job->state = JOB_STOPPED;
+    else job->state = JOB_DONE;
+    
+    if (job->state == old) return;
+    if (old == JOB_RUNNING) nrunning_jobs--;
+    if (job->state == JOB_RUNNING) nrunning_jobs++;
+    job->notify = 1;
+    job_changed(job);
+}
+
+static void proc_update(proc_t *p, const siginfo_t *si,
+                        const struct rusage *ru) {
+    job_t *job = p->job;
+    
+    switch (si->si_code) {
+    case CLD_EXITED:
+    case CLD_KILLED:
+    case CLD_DUMPED:
+        if (p->state == JOB_DONE) return;
+        if (p->state == JOB_RUNNING) job->nrunning--;
+        else job->nstopped--;
+        p->state = JOB_DONE;
+        p->status = si->si_code == CLD_EXITED ? si->si_status
+                                              : 128 + si->si_status;
+        p->ru = *ru;
+        clock_gettime(CLOCK_MONOTONIC, &p->end);
+        if (p->pidfd >= 0) close(p->pidfd);  /* Also leaves epoll set */
+        else nlegacy_procs--;
+        p->pidfd = -1;
+        break;
+    case CLD_STOPPED:
+        if (p->state != JOB_RUNNING) return;
+        p->state = JOB_STOPPED;
+        job->nrunning--;
+        job->nstopped++;
+        break;
+    case CLD_CONTINUED:
+        if (p->state != JOB_STOPPED) return;
+        p->state = JOB_RUNNING;
+        job->nstopped--;
+        job->nrunning++;
+        break;
     }
-    errno = saved_errno;  /* Restore errno */
+    
+    job_refresh(job);
+}
+
+static void update_winsize(void) {
+    struct winsize ws;
+    if (ioctl(shell_terminal, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0) return;
+    
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", ws.ws_col);
+    set_var("COLUMNS", buf, 0);
+    snprintf(buf, sizeof(buf), "%d", ws.ws_row);
+    set_var("LINES", buf, 0);
 }
 
 /*
- * SIGNAL INITIALIZATION - SETTING UP SHELL'S SIGNAL ENVIRONMENT
- * 
- * Why shell ignores job control signals (DEFENSE IN DEPTH):
- *   Primary: Shell in separate process group (not targeted by ^C)
- *   Backup: Ignore anyway (protects against races, bugs, manual kill)
- * 
- * The race that justifies ignoring:
- *   Time 0: Shell forks child (child in shell's group)
- *   Time 1: Shell calls tcsetpgrp(tty, child_pgid)
- *   Time 2: User presses ^C (FAST!)
- *   Time 3: Child calls setpgid(0, 0)
- *   
- *   If ^C at Time 2: Child still in shell's group!
- *   Signal goes to shell's group → shell gets SIGINT
- *   If shell didn't ignore → shell dies!
+ * waitid() with the 5th argument glibc doesn't expose
  * 
- * Signal inheritance:
- *   - Child inherits SIG_IGN (preserved across exec)
- *   - Child must reset to SIG_DFL before exec
- *   - Otherwise ^C won't work on child!
+ * The raw syscall fills a struct rusage for the reaped child, exactly
+ * what wait4() returns, but it also takes P_PIDFD and reports stop and
+ * continue events as a siginfo. Collected for every exit; `time`
+ * prints it.
  */
-static void init_signals(void) {
-    struct sigaction sa;
+static int waitid_rusage(idtype_t type, id_t id, siginfo_t *si, int options,
+                         struct rusage *ru) {
+    memset(ru, 0, sizeof(*ru));
+    return syscall(SYS_waitid, type, id, si, options, ru);
+}
+
+static void reap_sigchld(void) {
+    int flags = WSTOPPED | WCONTINUED | WNOHANG;
+    /* Also reap exits here for pidfd-less procs, and for the zygote's
+     * pool children (CLONE_PARENT makes them ours, but untracked) */
+    if (nlegacy_procs > 0 || zygote_pid > 0) flags |= WEXITED;
     
-    /* Ignore interactive signals in shell
-     * 
-     * Why ignore if shell not in foreground group?
-     * DEFENSE IN DEPTH:
-     *   - Normal: Signal goes to foreground group (child)
-     *   - Race: Child not yet in new group, signal hits shell
-     *   - Bug: Terminal driver error, manual kill
-     *   - Ignore ensures shell survives all cases
-     * 
-     * SIG_IGN is preserved across exec(), so children inherit
-     * Children must explicitly reset to SIG_DFL before exec
-     * Otherwise ^C won't kill child!
-     */
-    sa.sa_handler = SIG_IGN;
-    sigemptyset(&sa.sa_mask);  /* Don't block additional signals */
-    sa.sa_flags = 0;
+    for (;;) {
+        siginfo_t si;
+        struct rusage ru;
+        si.si_pid = 0;
+        if (waitid_rusage(P_ALL, 0, &si, flags, &ru) < 0 || si.si_pid == 0) break;
+        
+        proc_t *p = find_proc(si.si_pid);
+        if (p) proc_update(p, &si, &ru);
+    }
+}
+
+/* Drain the signalfd and act on what arrived (reap, resize, ^C) */
+static void read_signals(void) {
+    struct signalfd_siginfo ssi;
+    int chld = 0, winch = 0;
     
-    /* SIGINT: ^C (interrupt) */
-    sigaction(SIGINT, &sa, NULL);
-    /* SIGQUIT: ^\ (quit with core dump) */
-    sigaction(SIGQUIT, &sa, NULL);
-    /* SIGTSTP: ^Z (suspend) */
-    sigaction(SIGTSTP, &sa, NULL);
-    /* SIGTTIN: Background read from terminal */
-    sigaction(SIGTTIN, &sa, NULL);
-    /* SIGTTOU: Background write to terminal */
-    sigaction(SIGTTOU, &sa, NULL);
+    /* Drain: signals coalesce, so one pass per kind is what counts */
+    while (read(signal_fd, &ssi, sizeof(ssi)) == sizeof(ssi)) {
+        if (ssi.ssi_signo == SIGCHLD) chld = 1;
+        if (ssi.ssi_signo == SIGWINCH) winch = 1;
+        if (ssi.ssi_signo == SIGINT) sigint_seen = 1;
+    }
     
-    /* Handle SIGCHLD to reap background jobs
-     * SA_RESTART: Restart interrupted syscalls (read, write, etc.)
-     * SA_NOCLDSTOP: Don't receive SIGCHLD when children stop (only exit)
-     *               We use WUNTRACED in waitpid() instead for explicit control
-     */
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa, NULL);
+    if (chld) reap_sigchld();
+    if (winch && interactive) update_winsize();
 }
 
 /*
- * PATH SEARCH - LOCATING EXECUTABLES
- * 
- * PATH environment variable format: "/usr/bin:/bin:/usr/local/bin"
- * 
- * access(path, X_OK) - syscall: faccessat()
- * -------------------
- * Checks if file exists and is executable:
- *   - Follows symlinks
- *   - Checks real UID/GID (not effective)
- *   - Returns 0 if accessible, -1 if not
- * 
- * Alternative: stat() + S_IXUSR check
- *   struct stat st;
- *   stat(path, &st);
- *   if (st.st_mode & S_IXUSR) { // executable // }
- * 
- * Security note: TOCTOU race (Time-Of-Check-Time-Of-Use)
- *   access() → ... → exec()
- *   File could change between check and use!
- *   Better: Just try exec() and handle ENOENT/EACCES
+ * ^C while the shell itself blocks (`wait`): SIGINT is ignored, and an
+ * ignored signal is discarded when sent - unless it is blocked, then
+ * it stays pending (Linux never drops a blocked signal). So block it
+ * and add it to the signalfd for the duration; read_signals() sets
+ * sigint_seen. Interactive shells only: a script dies of ^C as usual.
  */
-static char *find_in_path(const char *cmd) {
-    static char buf[MAX_LINE];
-    
-    if (strchr(cmd, '/')) return (char *)cmd;
-    
-    char *path = getenv("PATH");
-    if (!path) path = "/usr/bin:/bin";
+static void catch_sigint(int on) {
+    sigset_t mask, intr;
+    if (!interactive) return;
     
-    char *path_copy = strdup(path);
-    char *dir = strtok(path_copy, ":");
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
     
-    while (dir) {
-        snprintf(buf, sizeof(buf), "%s/%s", dir, cmd);
-        if (access(buf, X_OK) == 0) {
-            free(path_copy);
-            return buf;
-        }
-        dir = strtok(NULL, ":");
+    if (on) {
+        sigint_seen = 0;
+        sigprocmask(SIG_BLOCK, &intr, NULL);
+        sigaddset(&mask, SIGINT);
+        signalfd(signal_fd, &mask, 0);
+    } else {
+        signalfd(signal_fd, &mask, 0);
+        sigprocmask(SIG_UNBLOCK, &intr, NULL);  /* Pending one: ignored */
     }
-    
-    free(path_copy);
-    return NULL;
 }
 
 /*
- * BUILTINS
+ * Process pending child events; timeout as for epoll_wait()
+ * (0 = poll, -1 = block until at least one event).
  */
-
-static int builtin_cd(command_t *cmd) {
-    char *dir = cmd->args[1] ? cmd->args[1] : getenv("HOME");
-    if (!dir) {
-        fprintf(stderr, "cd: HOME not set\n");
-        return 1;
-    }
-    if (chdir(dir) < 0) {
-        perror("cd");
-        return 1;
+static void reap_events(int timeout) {
+    struct epoll_event evs[64];
+    
+    int n = epoll_wait(event_fd, evs, 64, timeout);
+    for (int i = 0; i < n; i++) {
+        void *src = evs[i].data.ptr;
+        if (src == &ev_signal) {
+            read_signals();
+            continue;
+        }
+        if (src == &ev_stdin) {
+            stdin_ready = 1;
+            continue;
+        }
+        if (src == &ev_timer) {
+            input_timeout();
+            continue;
+        }
+        
+        proc_t *p = src;
+        if (p->pidfd < 0) continue;  /* Already reaped via SIGCHLD path */
+        
+        siginfo_t si;
+        struct rusage ru;
+        si.si_pid = 0;
+        if (waitid_rusage(P_PIDFD, p->pidfd, &si, WEXITED | WNOHANG, &ru) == 0 &&
+            si.si_pid != 0) {
+            proc_update(p, &si, &ru);
+        }
     }
-    return 0;
 }
 
-/*
- * BUILTIN: export - MARKING VARIABLES FOR ENVIRONMENT EXPORT
- * 
- * export VAR=value: Set and export
- * export VAR: Export existing variable
- * 
- * Implementation:
- *   1. Parse VAR=value or VAR
- *   2. Update shell's variable table
- *   3. Call setenv() to update environ[]
- *   4. Mark variable as exported
- * 
- * setenv() implementation (glibc):
- *   - Searches environ[] for "name="
- *   - If found: Replaces value (may realloc)
- *   - If not found: Expands environ[], appends "name=value"
- *   - environ[] is NULL-terminated array of "name=value" strings
- */
-static int builtin_export(command_t *cmd) {
-    for (int i = 1; i < cmd->argc; i++) {
-        char *eq = strchr(cmd->args[i], '=');
-        if (eq) {
-            *eq = '\0';
-            set_var(cmd->args[i], eq + 1, 1);
-            *eq = '=';
-        } else {
-            var_t *v = find_var(cmd->args[i]);
-            if (v) {
-                v->exported = 1;
-                setenv(v->name, v->value, 1);
-            }
-        }
+/* Block until no process of the job is running (all done, or stopped) */
+static void wait_for_job(job_t *job) {
+    while (job->nrunning > 0) {
+        reap_events(-1);
     }
-    return 0;
+    job->notify = 0;  /* Foreground: caller reports the outcome */
 }
 
-static int builtin_fg(command_t *cmd) {
-    (void)cmd;
-    if (njobs == 0) {
-        fprintf(stderr, "fg: no jobs\n");
-        return 1;
+/* SIGCONT the whole group; mark stopped members running right away so
+ * wait_for_job() doesn't return before the CLD_CONTINUED report. */
+static void continue_job(job_t *job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        proc_t *p = &job->procs[i];
+        if (p->state == JOB_STOPPED) {
+            p->state = JOB_RUNNING;
+            job->nstopped--;
+            job->nrunning++;
+        }
     }
-    
-    job_t *job = &jobs[njobs - 1];
-    tcsetpgrp(shell_terminal, job->pgid);
+    job_refresh(job);
+    job->notify = 0;
     killpg(job->pgid, SIGCONT);
+}
+
+/*
+ * Wait for a foreground job, then take the terminal back.
+ * Stopped (^Z): job stays in the table. Finished: job removed.
+ * Returns the job's exit status (0 if stopped).
+ */
+static int wait_foreground(job_t *job) {
+    wait_for_job(job);
     
-    int status;
-    waitpid(-job->pgid, &status, WUNTRACED);
-    tcsetpgrp(shell_terminal, shell_pgid);
+    if (interactive) {
+        tcsetpgrp(shell_terminal, shell_pgid);
+    }
     
-    if (WIFEXITED(status)) {
-        last_status = WEXITSTATUS(status);
-        remove_job(job->pgid);
-    } else if (WIFSTOPPED(status)) {
-        job->state = JOB_STOPPED;
+    if (job->state == JOB_STOPPED) {
+        job->background = 1;
+        printf("[%d] Stopped %s\n", job->id, job->command);
+        return 0;
     }
     
-    return last_status;
+    int status = job_status(job);
+    remove_job(job);
+    return status;
 }
 
-static int builtin_bg(command_t *cmd) {
-    (void)cmd;
-    if (njobs == 0) {
-        fprintf(stderr, "bg: no jobs\n");
-        return 1;
-    }
+/*
+ * Report background state changes. Called from the main loop only,
+ * never from signal context. at_prompt: cursor sits after "$ ", so
+ * move off that line first and redraw the prompt afterwards.
+ * 
+ * Walks the changed list, not the job table. A non-interactive shell
+ * reports nothing and keeps finished jobs until `wait` (or `jobs`)
+ * collects them, as sh does for scripts.
+ */
+static void notify_jobs(int at_prompt) {
+    int printed = 0;
     
-    job_t *job = &jobs[njobs - 1];
-    if (job->state == JOB_STOPPED) {
-        killpg(job->pgid, SIGCONT);
-        job->state = JOB_RUNNING;
+    while (interactive && changed_head) {
+        job_t *job = changed_head;
+        job_unchanged(job);
+        if (!job->notify) continue;
+        job->notify = 0;
+        
+        if (at_prompt && !printed) {
+            printf("\n");
+        }
+        if (job->state == JOB_DONE) {
+            printf("[%d] Done    %s\n", job->id, job->command);
+            forget_job(job);
+        } else if (job->state == JOB_STOPPED) {
+            printf("[%d] Stopped %s\n", job->id, job->command);
+        }
+        printed = 1;
     }
-    return 0;
+    
+    if (printed && at_prompt) printf("$ ");
+    fflush(stdout);
 }
 
-static int builtin_jobs(command_t *cmd) {
-    (void)cmd;
-    for (int i = 0; i < njobs; i++) {
-        const char *state = jobs[i].state == JOB_RUNNING ? "Running" : "Stopped";
-        printf("[%d] %s    %s\n", jobs[i].id, state, jobs[i].command);
+/*
+ * EVENT LOOP - ONE epoll SET FOR EVERYTHING THE SHELL WAITS ON
+ * 
+ * Sources in event_fd (epoll_data.ptr tells them apart):
+ *   proc_t *     pidfd of a child           → reap it (see above)
+ *   &ev_signal   signalfd: SIGCHLD SIGWINCH → stop/continue, resize
+ *   &ev_stdin    terminal/pipe input        → a line can be read
+ *   &ev_timer    timerfd for $TMOUT         → idle auto-logout
+ * 
+ * The REPL never blocks in read(): it blocks in epoll_wait() until
+ * stdin is readable, handling job events as they arrive. So:
+ *   - Zombies are reaped while the user sits at the prompt
+ *   - Job notifications + prompt redraw happen only here, in the main
+ *     thread, between reads (never in the middle of a printf())
+ *   - No periodic polling: an idle shell has zero wakeups
+ * 
+ * stdin is registered EPOLLONESHOT and re-armed only while waiting for
+ * input; otherwise type-ahead during a foreground job would make a
+ * level-triggered epoll_wait() spin.
+ * 
+ * Regular files can't be polled (epoll_ctl → EPERM): a script on
+ * stdin is simply read() directly.
+ */
+static void arm_stdin(void) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT,
+                              .data.ptr = &ev_stdin };
+    
+    if (stdin_pollable) {
+        epoll_ctl(event_fd, EPOLL_CTL_MOD, STDIN_FILENO, &ev);
     }
-    return 0;
 }
 
-static int is_builtin(const char *cmd) {
-    return strcmp(cmd, "cd") == 0 ||
-           strcmp(cmd, "export") == 0 ||
-           strcmp(cmd, "fg") == 0 ||
-           strcmp(cmd, "bg") == 0 ||
-           strcmp(cmd, "jobs") == 0;
+/* $TMOUT: seconds of idle input before an interactive shell exits */
+static void arm_timer(int on) {
+    const char *tmout = on && interactive ? get_var("TMOUT") : NULL;
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    
+    if (tmout) its.it_value.tv_sec = atoi(tmout);
+    if (its.it_value.tv_sec <= 0 && !timer_armed) return;
+    
+    timerfd_settime(timer_fd, 0, &its, NULL);
+    timer_armed = its.it_value.tv_sec > 0;
 }
 
-static int run_builtin(command_t *cmd) {
-    if (strcmp(cmd->args[0], "cd") == 0) return builtin_cd(cmd);
-    if (strcmp(cmd->args[0], "export") == 0) return builtin_export(cmd);
-    if (strcmp(cmd->args[0], "fg") == 0) return builtin_fg(cmd);
-    if (strcmp(cmd->args[0], "bg") == 0) return builtin_bg(cmd);
-    if (strcmp(cmd->args[0], "jobs") == 0) return builtin_jobs(cmd);
-    return 1;
+static void input_timeout(void) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0) return;
+    
+    printf("\ntimed out waiting for input: auto-logout\n");
+    exit(last_status);
 }
 
 /*
- * REDIRECTION SETUP
- * 
- * Called in child after fork, before exec.
- * Opens files and uses dup2 to redirect FDs.
+ * Block until stdin is readable. Background job changes that arrive
+ * meanwhile are reported at once, followed by a fresh prompt.
  */
-static void setup_redirects(command_t *cmd) {
-    for (int i = 0; i < cmd->nredirects; i++) {
-        int fd = open(cmd->redirects[i].file, cmd->redirects[i].flags,
-                     cmd->redirects[i].mode);
-        if (fd < 0) {
-            perror(cmd->redirects[i].file);
-            exit(1);
-        }
-        
-        if (dup2(fd, cmd->redirects[i].fd) < 0) {
-            perror("dup2");
-            exit(1);
-        }
-        close(fd);
+static void wait_for_input(void) {
+    if (!stdin_pollable) return;
+    
+    stdin_ready = 0;
+    arm_stdin();
+    arm_timer(1);
+    
+    while (!stdin_ready) {
+        reap_events(-1);
+        notify_jobs(1);
     }
+    
+    arm_timer(0);
 }
 
 /*
- * PIPELINE EXECUTION
- * 
- * Core algorithm:
- * 1. Create all pipes upfront
- * 2. Fork each command, setting up pipe FDs
- * 3. First child creates new PGRP, others join it
- * 4. Give terminal to PGRP if foreground
- * 5. Close all pipe FDs in parent
- * 6. Wait for completion (foreground) or return (background)
- * 
- * Race condition handling: Both parent and child call setpgid() to
- * avoid race where parent tries to tcsetpgrp() before child setpgid().
+ * Set up the epoll set, signalfd (SIGCHLD, SIGWINCH), stdin and timer.
+ * Done for every shell (scripts run background jobs too).
  */
-static int execute_pipeline(pipeline_t *pl) {
-    if (pl->ncmds == 0) return 0;
+static void init_events(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
     
-    /* Single builtin without pipes */
-    if (pl->ncmds == 1 && is_builtin(pl->cmds[0].args[0]) && !pl->background) {
-        int status = run_builtin(&pl->cmds[0]);
-        return pl->negate ? !status : status;
-    }
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || event_fd < 0) die("init_events");
     
-    int pipes[MAX_CMDS][2];
-    pid_t pids[MAX_CMDS];
-    pid_t pgid = 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &ev_signal };
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, signal_fd, &ev);
     
-    /* Create pipes */
-    for (int i = 0; i < pl->ncmds - 1; i++) {
-        if (pipe(pipes[i]) < 0) die("pipe");
-    }
+    ev.data.ptr = &ev_timer;
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, timer_fd, &ev);
     
-    /* Fork and execute commands */
-    for (int i = 0; i < pl->ncmds; i++) {
-        pid_t pid = fork();
-        if (pid < 0) die("fork");
+    /* Registered disarmed; wait_for_input() arms it */
+    ev.events = EPOLLONESHOT;
+    ev.data.ptr = &ev_stdin;
+    stdin_pollable = epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+    
+    if (interactive) update_winsize();
+}
+
+/*
+ * ( list ): a forked copy of the shell runs the list. exec_stage() has
+ * closed the event fds and forgotten the parent's jobs; this child
+ * gets its own set for the jobs it starts, which join its process
+ * group (the job's) instead of making their own. Never interactive:
+ * the terminal stays with that group.
+ */
+static void subshell_enter(void) {
+    interactive = 0;
+    in_subshell = 1;
+    memset(proc_hash, 0, sizeof(proc_hash));
+    nlegacy_procs = 0;
+    nstage_threads = 0;           /* The parent's, not running here */
+    init_events();
+}
+
+/*
+ * INPUT - LINES FROM stdin VIA THE EVENT LOOP
+ * 
+ * stdio's fgets() can't be used with epoll: it may hold a buffered
+ * line while the fd itself reports "not readable". So input is
+ * read() into our own buffer, and epoll only waited on when that
+ * buffer holds no complete line.
+ * 
+ * The buffer has no line length limit. It is refilled INPUT_BLOCK
+ * bytes at a time and grows (doubling) only when one line doesn't
+ * fit, so its size follows the longest line seen:
+ * 
+ *   input_buf: [ consumed | current line ... | next lines | free ]
+ *              0          start                 len         cap
+ * 
+ * Lines are handed out in place, newline replaced by '\0', so the
+ * lexer tokenizes the buffer itself; the pointer is good until the
+ * next read_line(). Consumed bytes are only dropped (one memmove of
+ * the unread tail) when the free space runs low.
+ * 
+ * join: "\⏎" continues the line (an odd number of trailing
+ * backslashes, so "\\⏎" doesn't). The pieces are packed down over
+ * the "\⏎"s as they are found, each byte moved at most once:
+ * 
+ *   echo foo\⏎bar\⏎baz⏎  →  "echo foobarbaz"
+ * 
+ * NULL on EOF with nothing buffered. *nl (if not NULL): 1 when a
+ * newline ended the line, 0 when EOF did.
+ */
+#define INPUT_BLOCK (64 * 1024)
+
+static char *input_buf;
+static size_t input_cap;
+static size_t input_start;         /* Current line */
+static size_t input_len;           /* End of buffered data */
+static int input_eof;
+static int stdin_is_input = 1;     /* fd 0 is what read_line() reads */
+
+static char *read_line(int join, int *nl) {
+    size_t w = input_start;        /* End of the joined text so far */
+    size_t r = input_start;        /* Start of the unjoined rest */
+    size_t scan = input_start;     /* No '\n' in [r, scan) */
+    
+    for (;;) {
+        char *p = input_len > scan ? memchr(input_buf + scan, '\n', input_len - scan) : NULL;
+        size_t e = p ? (size_t)(p - input_buf) : input_len;
         
-        if (pid == 0) {  /* Child */
-            /* Reset signal handlers to default */
-            signal(SIGINT, SIG_DFL);
-            signal(SIGQUIT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-            signal(SIGTTIN, SIG_DFL);
-            signal(SIGTTOU, SIG_DFL);
-            signal(SIGCHLD, SIG_DFL);
-            
-            /* Set process group */
-            if (i == 0) {
-                pgid = getpid();
-                setpgid(0, pgid);
-                if (interactive && !pl->background) {
-                    tcsetpgrp(shell_terminal, pgid);
+        if (p && join) {
+            size_t bs = 0;
+            while (e - bs > r && input_buf[e - bs - 1] == '\\') bs++;
+            if (bs % 2) {
+                if (w != r) memmove(input_buf + w, input_buf + r, e - 1 - r);
+                w += e - 1 - r;
+                r = scan = e + 1;
+                if (interactive && !memchr(input_buf + r, '\n', input_len - r)) {
+                    printf("> ");
+                    fflush(stdout);
                 }
-            } else {
-                setpgid(0, pgid);
-            }
-            
-            /* Setup pipes */
-            if (i > 0) {
-                dup2(pipes[i-1][0], 0);
-            }
-            if (i < pl->ncmds - 1) {
-                dup2(pipes[i][1], 1);
-            }
-            
-            /* Close all pipe FDs */
-            for (int j = 0; j < pl->ncmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            /* Setup redirections */
-            setup_redirects(&pl->cmds[i]);
-            
-            /* Execute builtin or external command */
-            if (is_builtin(pl->cmds[i].args[0])) {
-                exit(run_builtin(&pl->cmds[i]));
+                continue;
             }
-            
-            char *path = find_in_path(pl->cmds[i].args[0]);
-            if (!path) {
-                fprintf(stderr, "%s: command not found\n", pl->cmds[i].args[0]);
-                exit(127);
-            }
-            
-            execv(path, pl->cmds[i].args);
-            perror("execv");
-            exit(1);
         }
         
-        /* Parent */
-        pids[i] = pid;
-        if (i == 0) {
-            pgid = pid;
-            setpgid(pid, pgid);
-            if (interactive && !pl->background) {
-                tcsetpgrp(shell_terminal, pgid);
-            }
-        } else {
-            setpgid(pid, pgid);
+        if (p || (input_eof && input_len > input_start)) {
+            if (w != r) memmove(input_buf + w, input_buf + r, e - r);
+            w += e - r;
+            input_buf[w] = '\0';   /* The '\n', or the spare byte at EOF */
+            char *line = input_buf + input_start;
+            input_start = p ? e + 1 : input_len;
+            if (nl) *nl = p != NULL;
+            return line;
         }
-    }
-    
-    /* Close all pipes in parent */
-    for (int i = 0; i < pl->ncmds - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
-    }
-    
-    last_bg_pid = pgid;
-    
-    if (pl->background) {
-        add_job(pgid, "background job", 1);
-        return 0;
-    }
-    
-    /* Wait for foreground job */
-    int status = 0;
-    for (int i = 0; i < pl->ncmds; i++) {
-        int wstatus;
-        waitpid(pids[i], &wstatus, WUNTRACED);
+        if (input_eof) return NULL;
+        scan = input_len;
         
-        if (WIFSTOPPED(wstatus)) {
-            add_job(pgid, "stopped job", 0);
-            printf("[%d] Stopped\n", njobs);
-            if (interactive) {
-                tcsetpgrp(shell_terminal, shell_pgid);
+        /* Room for a block (and the spare byte): drop what's been
+         * consumed, and grow only if that isn't enough */
+        if (input_cap - input_len < INPUT_BLOCK / 2) {
+            if (input_start > 0) {
+                memmove(input_buf, input_buf + input_start, input_len - input_start);
+                w -= input_start;
+                r -= input_start;
+                scan -= input_start;
+                input_len -= input_start;
+                input_start = 0;
             }
-            return 0;
-        }
-        
-        if (i == pl->ncmds - 1) {
-            if (WIFEXITED(wstatus)) {
-                status = WEXITSTATUS(wstatus);
-            } else if (WIFSIGNALED(wstatus)) {
-                status = 128 + WTERMSIG(wstatus);
+            if (input_cap - input_len < INPUT_BLOCK / 2) {
+                input_cap = input_cap ? input_cap * 2 : INPUT_BLOCK;
+                input_buf = realloc(input_buf, input_cap);
+                if (!input_buf) die("realloc");
             }
         }
+        
+        wait_for_input();
+        
+        ssize_t n = read(STDIN_FILENO, input_buf + input_len,
+                         input_cap - input_len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) input_eof = 1;
+        else input_len += n;
     }
+}
+
+/*
+ * SIGNAL INITIALIZATION - SETTING UP SHELL'S SIGNAL ENVIRONMENT
+ * 
+ * Why shell ignores job control signals (DEFENSE IN DEPTH):
+ *   Primary: Shell in separate process group (not targeted by ^C)
+ *   Backup: Ignore anyway (protects against races, bugs, manual kill)
+ * 
+ * The race that justifies ignoring:
+ *   Time 0: Shell forks child (child in shell's group)
+ *   Time 1: Shell calls tcsetpgrp(tty, child_pgid)
+ *   Time 2: User presses ^C (FAST!)
+ *   Time 3: Child calls setpgid(0, 0)
+ *   
+ *   If ^C at Time 2: Child still in shell's group!
+ *   Signal goes to shell's group → shell gets SIGINT
+ *   If shell didn't ignore → shell dies!
+ * 
+ * Signal inheritance:
+ *   - Child inherits SIG_IGN (preserved across exec)
+ *   - Child must reset to SIG_DFL before exec
+ *   - Otherwise ^C won't work on child!
+ */
+static void init_signals(void) {
+    struct sigaction sa;
+    
+    /* Ignore interactive signals in shell
+     * 
+     * Why ignore if shell not in foreground group?
+     * DEFENSE IN DEPTH:
+     *   - Normal: Signal goes to foreground group (child)
+     *   - Race: Child not yet in new group, signal hits shell
+     *   - Bug: Terminal driver error, manual kill
+     *   - Ignore ensures shell survives all cases
+     * 
+     * SIG_IGN is preserved across exec(), so children inherit
+     * Children must explicitly reset to SIG_DFL before exec
+     * Otherwise ^C won't kill child!
+     */
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);  /* Don't block additional signals */
+    sa.sa_flags = 0;
+    
+    /* SIGINT: ^C (interrupt) */
+    sigaction(SIGINT, &sa, NULL);
+    /* SIGQUIT: ^\ (quit with core dump) */
+    sigaction(SIGQUIT, &sa, NULL);
+    /* SIGTSTP: ^Z (suspend) */
+    sigaction(SIGTSTP, &sa, NULL);
+    /* SIGTTIN: Background read from terminal */
+    sigaction(SIGTTIN, &sa, NULL);
+    /* SIGTTOU: Background write to terminal */
+    sigaction(SIGTTOU, &sa, NULL);
+    
+    /* SIGCHLD: no handler, it is blocked and read via signalfd
+     * (see init_events() / reap_events()) */
+}
+
+/*
+ * PATH SEARCH - LOCATING EXECUTABLES
+ * 
+ * PATH environment variable format: "/usr/bin:/bin:/usr/local/bin"
+ * 
+ * access(path, X_OK) - syscall: faccessat()
+ * -------------------
+ * Checks if file exists and is executable:
+ *   - Follows symlinks
+ *   - Checks real UID/GID (not effective)
+ *   - Returns 0 if accessible, -1 if not
+ * 
+ * Alternative: stat() + S_IXUSR check
+ *   struct stat st;
+ *   stat(path, &st);
+ *   if (st.st_mode & S_IXUSR) { // executable // }
+ * 
+ * Security note: TOCTOU race (Time-Of-Check-Time-Of-Use)
+ *   access() → ... → exec()
+ *   File could change between check and use!
+ *   Better: Just try exec() and handle ENOENT/EACCES
+ * 
+ * PATH CACHE (like bash's `hash` table):
+ *   Uncached: one access() per PATH directory, per command, per launch
+ *     Script running "grep" 100k times → 100k PATH walks
+ *   Cached: command → absolute path, kept in the parent shell
+ *     Hit: one hash + strcmp, zero syscalls
+ * 
+ * Invalidation:
+ *   - PATH assigned via set_var()/export → path_cache_clear()
+ *   - PATH directory mtime changed (binary added/removed/renamed):
+ *     a directory's mtime changes whenever an entry is created,
+ *     deleted or renamed in it. Dirs are re-stat()'d at most once
+ *     per second, so the check costs ~nothing per command.
+ *   - exec of a cached path fails with ENOENT → entry dropped
+ * 
+ * Negative caching: "not found" is remembered as well (path == NULL),
+ * so repeated typos / probes for optional tools skip the PATH walk.
+ * Same invalidation rules apply (a newly installed binary bumps its
+ * directory's mtime; `hash -r` forces it).
+ */
+#define PATH_CACHE_BUCKETS 256
+#define MAX_PATH_DIRS 64
+
+typedef struct path_entry {
+    char *name;
+    char *path;                    /* NULL: known NOT to be on PATH */
+    int hits;
+    struct path_entry *next;
+} path_entry_t;
+
+typedef struct {
+    char *dir;
+    struct timespec mtime;
+} path_dir_t;
+
+static path_entry_t *path_cache[PATH_CACHE_BUCKETS];
+static path_dir_t path_dirs[MAX_PATH_DIRS];
+static int npath_dirs = -1;        /* -1: dirs not loaded for current PATH */
+static time_t path_dirs_checked;
+
+static unsigned path_hash(const char *s) {
+    unsigned h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h % PATH_CACHE_BUCKETS;
+}
+
+static void path_cache_clear(void) {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        path_entry_t *e = path_cache[i];
+        while (e) {
+            path_entry_t *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        path_cache[i] = NULL;
+    }
+    for (int i = 0; i < npath_dirs; i++) {
+        free(path_dirs[i].dir);
+    }
+    npath_dirs = -1;
+}
+
+static void path_cache_forget(const char *cmd) {
+    path_entry_t **pp = &path_cache[path_hash(cmd)];
+    for (; *pp; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, cmd) == 0) {
+            path_entry_t *e = *pp;
+            *pp = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+/* Split PATH once per cache generation, recording each dir's mtime */
+static void path_dirs_load(void) {
+    char *path = getenv("PATH");
+    if (!path) path = "/usr/bin:/bin";
+    
+    char *path_copy = strdup(path);
+    char *dir = strtok(path_copy, ":");
+    
+    npath_dirs = 0;
+    while (dir && npath_dirs < MAX_PATH_DIRS) {
+        struct stat st;
+        path_dirs[npath_dirs].dir = strdup(dir);
+        if (stat(dir, &st) == 0) {
+            path_dirs[npath_dirs].mtime = st.st_mtim;
+        } else {
+            path_dirs[npath_dirs].mtime.tv_sec = 0;
+            path_dirs[npath_dirs].mtime.tv_nsec = 0;
+        }
+        npath_dirs++;
+        dir = strtok(NULL, ":");
+    }
+    
+    free(path_copy);
+    path_dirs_checked = time(NULL);
+}
+
+/* Any PATH dir changed since we cached? Throttled to once per second. */
+static int path_dirs_stale(void) {
+    time_t now = time(NULL);
+    if (now == path_dirs_checked) return 0;
+    path_dirs_checked = now;
+    
+    for (int i = 0; i < npath_dirs; i++) {
+        struct stat st;
+        struct timespec m = { 0, 0 };
+        if (stat(path_dirs[i].dir, &st) == 0) m = st.st_mtim;
+        if (m.tv_sec != path_dirs[i].mtime.tv_sec ||
+            m.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static char *find_in_path(const char *cmd) {
+    static char buf[MAX_LINE];
+    
+    if (strchr(cmd, '/')) return (char *)cmd;
+    
+    if (npath_dirs >= 0 && path_dirs_stale()) path_cache_clear();
+    if (npath_dirs < 0) path_dirs_load();
+    
+    unsigned h = path_hash(cmd);
+    for (path_entry_t *e = path_cache[h]; e; e = e->next) {
+        if (strcmp(e->name, cmd) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+    
+    path_entry_t *e = malloc(sizeof(*e));
+    e->name = strdup(cmd);
+    e->path = NULL;
+    e->hits = 1;
+    e->next = path_cache[h];
+    path_cache[h] = e;
+    
+    for (int i = 0; i < npath_dirs; i++) {
+        snprintf(buf, sizeof(buf), "%s/%s", path_dirs[i].dir, cmd);
+        if (access(buf, X_OK) == 0) {
+            e->path = strdup(buf);
+            return e->path;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * BINARY FD CACHE - EXEC WITHOUT A PATH WALK
+ * 
+ * Even with a PATH cache hit, execve("/usr/bin/grep") makes the kernel
+ * walk "/", "usr", "bin", "grep" again (path_lookupat(), one dentry
+ * lookup + permission check per component) on every launch.
+ * 
+ * O_PATH - a handle to a file without opening it for I/O
+ * -------------------------------------------------------
+ *   open(path, O_PATH) resolves the path once and pins the inode.
+ *   No read permission needed, no file I/O possible; enough to
+ *   fstat() it or to exec it:
+ * 
+ *   execveat(fd, "", argv, envp, AT_EMPTY_PATH) - syscall
+ *     Executes the file fd refers to. Zero path components resolved.
+ *     (fexecve() is this syscall in glibc.)
+ * 
+ * The shell keeps an LRU of such fds for the last BIN_CACHE_SIZE
+ * executables it launched. The fds are O_CLOEXEC: children never see
+ * them, and execveat() of an O_CLOEXEC fd is fine for ELF binaries.
+ * 
+ * Only ELF files are cached: for a "#!" script the kernel would have
+ * to hand the interpreter "/dev/fd/N", which close-on-exec has already
+ * closed, so execveat() fails with ENOENT.
+ * 
+ * Only absolute paths are cached: "./prog" or "bin/prog" (passed
+ * through by find_in_path()) name another file after every cd, and
+ * the fd would still pass the fstat() check below.
+ * 
+ * Invalidation (the fd pins an inode, the path may move on):
+ *   - Every hit: fstat(fd), no path walk. st_nlink == 0 (deleted) or
+ *     st_mtim changed (rewritten in place) → drop.
+ *   - At most once per second per entry: stat(path). Different
+ *     st_dev/st_ino (replaced by rename, e.g. a package upgrade or
+ *     "make" writing a new ./prog) → drop.
+ *   - `hash -r` → drop everything.
+ * 
+ * Why posix_spawn() can't use it: it takes a path only. Passing
+ * "/proc/self/fd/N" works but the new process's comm (ps, pgrep,
+ * killall) becomes "N". Stages with a cached fd are launched with
+ * vfork() + execveat() instead (see vfork_stage()).
+ */
+#define BIN_CACHE_SIZE 32
+
+typedef struct {
+    char *path;                    /* NULL: slot free */
+    int fd;                        /* O_PATH | O_CLOEXEC */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t checked;                /* Last stat(path) */
+    unsigned long used;            /* LRU clock */
+} bin_entry_t;
+
+static bin_entry_t bin_cache[BIN_CACHE_SIZE];
+static unsigned long bin_clock;
+
+static void bin_cache_drop(bin_entry_t *b) {
+    close(b->fd);
+    free(b->path);
+    b->path = NULL;
+    b->fd = -1;
+}
+
+/* Child after close_range(): the fds are gone, just forget them */
+static void bin_cache_abandon(void) {
+    for (int i = 0; i < BIN_CACHE_SIZE; i++) {
+        free(bin_cache[i].path);
+        bin_cache[i].path = NULL;
+        bin_cache[i].fd = -1;
+    }
+}
+
+static void bin_cache_clear(void) {
+    for (int i = 0; i < BIN_CACHE_SIZE; i++) {
+        if (bin_cache[i].path) bin_cache_drop(&bin_cache[i]);
+    }
+}
+
+/* Does the cached fd still name what `path` names? */
+static int bin_cache_valid(bin_entry_t *b) {
+    struct stat st;
+    if (fstat(b->fd, &st) < 0 || st.st_nlink == 0 ||
+        st.st_mtim.tv_sec != b->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != b->mtime.tv_nsec) {
+        return 0;
+    }
+    
+    time_t now = time(NULL);
+    if (now == b->checked) return 1;
+    b->checked = now;
+    return stat(b->path, &st) == 0 && st.st_dev == b->dev &&
+           st.st_ino == b->ino;
+}
+
+/* Open `path` as O_PATH if it is an ELF executable; -1 otherwise */
+static int bin_open(const char *path, struct stat *st) {
+    char magic[4];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (n != sizeof(magic) || memcmp(magic, "\177ELF", 4) != 0) return -1;
+    
+    fd = open(path, O_PATH | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * fd to execveat() for `path`, or -1 to exec by path.
+ * The fd stays owned by the cache.
+ */
+static int bin_cache_fd(const char *path) {
+    bin_entry_t *slot = &bin_cache[0];
+    
+    if (path[0] != '/') return -1;  /* Relative: depends on the cwd */
+    
+    for (int i = 0; i < BIN_CACHE_SIZE; i++) {
+        bin_entry_t *b = &bin_cache[i];
+        if (b->path && strcmp(b->path, path) == 0) {
+            if (bin_cache_valid(b)) {
+                b->used = ++bin_clock;
+                return b->fd;
+            }
+            bin_cache_drop(b);
+            slot = b;
+            break;
+        }
+        /* Free slot, else least recently used */
+        if (!b->path || (slot->path && b->used < slot->used)) slot = b;
+    }
+    
+    struct stat st;
+    int fd = bin_open(path, &st);
+    if (fd < 0) return -1;
+    
+    if (slot->path) bin_cache_drop(slot);
+    slot->path = strdup(path);
+    slot->fd = fd;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->checked = time(NULL);
+    slot->used = ++bin_clock;
+    return fd;
+}
+
+/*
+ * BUILTINS
+ */
+
+static int builtin_cd(command_t *cmd) {
+    char *dir = cmd->args[1] ? cmd->args[1] : getenv("HOME");
+    if (!dir) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(dir) < 0) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+/* exit [n]: n modulo 256, default $?. In ( list ), leaves the subshell */
+static int builtin_exit(command_t *cmd) {
+    int status = cmd->argc > 1 ? atoi(cmd->args[1]) & 255 : last_status;
+    fflush(stdout);
+    exit(status);
+}
+
+/*
+ * BUILTIN: export - MARKING VARIABLES FOR ENVIRONMENT EXPORT
+ * 
+ * export VAR=value: Set and export
+ * export VAR: Export existing variable
+ * 
+ * Implementation:
+ *   1. Parse VAR=value or VAR
+ *   2. Update shell's variable table
+ *   3. Call setenv() to update environ[]
+ *   4. Mark variable as exported
+ * 
+ * setenv() implementation (glibc):
+ *   - Searches environ[] for "name="
+ *   - If found: Replaces value (may realloc)
+ *   - If not found: Expands environ[], appends "name=value"
+ *   - environ[] is NULL-terminated array of "name=value" strings
+ */
+static int builtin_export(command_t *cmd) {
+    for (int i = 1; i < cmd->argc; i++) {
+        char *eq = strchr(cmd->args[i], '=');
+        if (eq) {
+            *eq = '\0';
+            set_var(cmd->args[i], eq + 1, 1);
+            *eq = '=';
+        } else {
+            var_t *v = find_var(cmd->args[i]);
+            if (v) {
+                v->exported = 1;
+                setenv(v->name, v->value, 1);
+                if (strcmp(v->name, "PATH") == 0) path_cache_clear();
+            }
+        }
+    }
+    return 0;
+}
+
+static int builtin_fg(command_t *cmd) {
+    if (njobs == 0) {
+        fprintf(stderr, "fg: no jobs\n");
+        return 1;
+    }
+    
+    job_t *job = cmd->argc > 1 ? job_from_spec(cmd->args[1]) : find_job(njobs);
+    if (!job) {
+        fprintf(stderr, "fg: %s: no such job\n", cmd->args[1]);
+        return 1;
+    }
+    job->background = 0;
+    if (interactive) {
+        tcsetpgrp(shell_terminal, job->pgid);
+    }
+    continue_job(job);
+    
+    last_status = wait_foreground(job);
+    return last_status;
+}
+
+static int builtin_bg(command_t *cmd) {
+    if (njobs == 0) {
+        fprintf(stderr, "bg: no jobs\n");
+        return 1;
+    }
+    
+    job_t *job = cmd->argc > 1 ? job_from_spec(cmd->args[1]) : find_job(njobs);
+    if (!job) {
+        fprintf(stderr, "bg: %s: no such job\n", cmd->args[1]);
+        return 1;
+    }
+    if (job->state == JOB_STOPPED) {
+        continue_job(job);
+    }
+    return 0;
+}
+
+/*
+ * BUILTIN: jobs - LIST, MEASURE AND LIMIT JOBS
+ * 
+ * jobs:                    [id] state command
+ * jobs -l:                 also the pids and, for a job with a cgroup
+ *                          leaf (set -o cgroups), its accounting:
+ *                          cpu.stat (usage, user, system, throttled)
+ *                          and memory.current / memory.peak (5.19+)
+ * jobs limit %job k=v ...  writes the job's leaf:
+ *                            cpu=50%      cpu.max "50000 100000": 50ms
+ *                                         per 100ms period (200% = 2
+ *                                         CPUs), cpu=max lifts it
+ *                            memory=512M  memory.max (K/M/G/T), or max
+ *                            io=200       io.weight, 1-10000 (100 is
+ *                                         the default)
+ * 
+ * A limit applies at once to everything in the leaf, including what
+ * the job has forked since. ENOENT from a control file means base
+ * doesn't delegate that controller.
+ */
+static void cg_size_str(char *buf, size_t size, long long bytes) {
+    if (bytes >= 1 << 30) snprintf(buf, size, "%.1fG", bytes / 1073741824.0);
+    else if (bytes >= 1 << 20) snprintf(buf, size, "%.1fM", bytes / 1048576.0);
+    else snprintf(buf, size, "%lldK", bytes >> 10);
+}
+
+static void cg_report(job_t *job) {
+    char buf[1024], cur[32], peak[32];
+    
+    printf("    cgroup %s/job%u:", cg_name, job->cgseq);
+    if (cg_read(job->cgfd, "cpu.stat", buf, sizeof(buf)) == 0) {
+        printf(" cpu %.3fs (user %.3fs, sys %.3fs", cg_key(buf, "usage_usec") / 1e6,
+               cg_key(buf, "user_usec") / 1e6, cg_key(buf, "system_usec") / 1e6);
+        long long thr = cg_key(buf, "throttled_usec");
+        if (thr >= 0) printf(", throttled %.3fs", thr / 1e6);
+        printf(")");
+    }
+    if (cg_read(job->cgfd, "memory.current", buf, sizeof(buf)) == 0) {
+        cg_size_str(cur, sizeof(cur), atoll(buf));
+        printf(" memory %s", cur);
+        if (cg_read(job->cgfd, "memory.peak", buf, sizeof(buf)) == 0) {
+            cg_size_str(peak, sizeof(peak), atoll(buf));
+            printf(" (peak %s)", peak);
+        }
+    }
+    printf("\n");
+}
+
+static int cg_limit(job_t *job, const char *arg) {
+    const char *eq = strchr(arg, '=');
+    const char *v = eq ? eq + 1 : "";
+    const char *file;
+    char val[64], *end;
+    
+    if (eq && strncmp(arg, "cpu=", 4) == 0) {
+        file = "cpu.max";
+        if (strcmp(v, "max") == 0) {
+            snprintf(val, sizeof(val), "max 100000");
+        } else {
+            double pct = strtod(v, &end);
+            if (*end == '%') end++;
+            if (end == v || *end || pct <= 0) goto bad;
+            long quota = (long)(pct * 1000);       /* µs per 100ms */
+            snprintf(val, sizeof(val), "%ld 100000", quota < 1000 ? 1000 : quota);
+        }
+    } else if (eq && strncmp(arg, "memory=", 7) == 0) {
+        file = "memory.max";
+        if (strcmp(v, "max") == 0) {
+            snprintf(val, sizeof(val), "max");
+        } else {
+            long long bytes = strtoll(v, &end, 10);
+            const char *units = "KMGT", *u = *end ? strchr(units, toupper(*end)) : NULL;
+            if (u) end++;
+            if (end == v || *end || bytes <= 0) goto bad;
+            snprintf(val, sizeof(val), "%lld", bytes << (u ? 10 * (u - units + 1) : 0));
+        }
+    } else if (eq && strncmp(arg, "io=", 3) == 0) {
+        file = "io.weight";
+        long w = strcmp(v, "default") == 0 ? 100 : strtol(v, &end, 10);
+        if (w < 1 || w > 10000 || (strcmp(v, "default") != 0 && *end)) goto bad;
+        snprintf(val, sizeof(val), "default %ld", w);
+    } else {
+        goto bad;
+    }
+    
+    if (cg_write(job->cgfd, file, val) == 0) return 0;
+    if (errno == ENOENT) {
+        fprintf(stderr, "jobs: %s: controller not delegated here\n", file);
+    } else {
+        fprintf(stderr, "jobs: %s: %s\n", file, strerror(errno));
+    }
+    return 1;
+bad:
+    fprintf(stderr, "jobs: %s: expected cpu=N%%, memory=SIZE or io=WEIGHT\n", arg);
+    return 1;
+}
+
+static int builtin_jobs(command_t *cmd) {
+    int long_fmt = 0;
+    
+    if (cmd->argc > 1 && strcmp(cmd->args[1], "limit") == 0) {
+        job_t *job = cmd->argc > 2 ? job_from_spec(cmd->args[2]) : NULL;
+        if (!job || cmd->argc < 4) {
+            fprintf(stderr, "jobs: usage: jobs limit %%job cpu=N%%|memory=SIZE|io=WEIGHT ...\n");
+            return 1;
+        }
+        if (job->cgfd < 0) {
+            fprintf(stderr, "jobs: %s: not in a cgroup (set -o cgroups)\n", cmd->args[2]);
+            return 1;
+        }
+        int status = 0;
+        for (int i = 3; i < cmd->argc; i++) status |= cg_limit(job, cmd->args[i]);
+        return status;
+    }
+    if (cmd->argc > 1 && strcmp(cmd->args[1], "-l") == 0) long_fmt = 1;
+    
+    reap_events(0);
+    for (int id = 1; id <= njobs; id++) {
+        job_t *job = find_job(id);
+        if (!job) continue;
+        const char *state = job->state == JOB_RUNNING ? "Running" :
+                            job->state == JOB_STOPPED ? "Stopped" : "Done";
+        printf("[%d] %s    %s\n", job->id, state, job->command);
+        if (long_fmt) {
+            printf("    pids");
+            for (int i = 0; i < job->nprocs; i++) printf(" %d", (int)job->procs[i].pid);
+            printf("\n");
+            if (job->cgfd >= 0) cg_report(job);
+        }
+        if (builtin_in_pipeline) continue;
+        if (job->state == JOB_DONE) {
+            forget_job(job);
+        } else {
+            job->notify = 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * BUILTIN: wait - JOIN BACKGROUND JOBS
+ * 
+ * wait:               until no job is running; status 0
+ * wait PID|%job ...:  until each one is done; status of the last
+ *                     (128+N if killed by signal N, 127 if unknown)
+ * wait -n [id ...]:   until the next job (of those listed) is done;
+ *                     its status, 127 if nothing is left to wait for
+ * 
+ * No waitpid(): it blocks in reap_events() like a foreground job and
+ * reads the state proc_update() leaves behind, so exits are still
+ * collected through the pidfds. `wait -n` takes the oldest finished
+ * job off the changed list - O(1) per completion, however many jobs
+ * are outstanding. PIDs are looked up in the proc hash, then among
+ * already-reported jobs (bg_status[]).
+ * 
+ * A job collected here leaves the table without a "Done" report.
+ * A stopped job counts as finished with 128+SIGTSTP. ^C returns 130.
+ */
+static job_t *wait_operand(const char *arg, proc_t **proc) {
+    *proc = NULL;
+    if (arg[0] == '%') return job_from_spec(arg);
+    if (!arg[0] || arg[strspn(arg, "0123456789")]) return NULL;
+    
+    proc_t *p = find_proc(atoi(arg));
+    if (!p) return NULL;
+    *proc = p;
+    return p->job;
+}
+
+static int wait_collect(job_t *job, proc_t *p) {
+    if (p ? p->state == JOB_STOPPED : job->state == JOB_STOPPED) {
+        return 128 + SIGTSTP;
+    }
+    int status = p ? p->status : job_status(job);
+    if (job->state == JOB_DONE) remove_job(job);
+    return status;
+}
+
+static int wait_one(const char *arg) {
+    proc_t *p;
+    job_t *job = wait_operand(arg, &p);
+    int status;
+    
+    if (!job) {
+        if (arg[0] != '%' && bg_status_find(atoi(arg), &status)) return status;
+        fprintf(stderr, "wait: %s: no such job\n", arg);
+        return 127;
+    }
+    while (!sigint_seen && (p ? p->state == JOB_RUNNING : job->nrunning > 0)) {
+        reap_events(-1);
+    }
+    return sigint_seen ? 130 : wait_collect(job, p);
+}
+
+static int wait_next(command_t *cmd, int first) {
+    while (!sigint_seen) {
+        int live = 0;
+        if (first < cmd->argc) {
+            for (int i = first; i < cmd->argc; i++) {
+                proc_t *p;
+                job_t *job = wait_operand(cmd->args[i], &p);
+                if (!job) continue;
+                if (job->state == JOB_DONE) return wait_collect(job, NULL);
+                live |= job->state == JOB_RUNNING;
+            }
+        } else {
+            for (job_t *job = changed_head; job; job = job->cnext) {
+                if (job->state == JOB_DONE) return wait_collect(job, NULL);
+            }
+            live = nrunning_jobs > 0;
+        }
+        if (!live) return 127;
+        reap_events(-1);
+    }
+    return 130;
+}
+
+static int builtin_wait(command_t *cmd) {
+    int status = 0, i = 1, next = 0;
+    
+    if (i < cmd->argc && strcmp(cmd->args[i], "-n") == 0) {
+        next = 1;
+        i++;
+    }
+    
+    catch_sigint(1);
+    if (next) {
+        status = wait_next(cmd, i);
+    } else if (i < cmd->argc) {
+        for (; i < cmd->argc && !sigint_seen; i++) status = wait_one(cmd->args[i]);
+    } else {
+        while (nrunning_jobs > 0 && !sigint_seen) reap_events(-1);
+        /* Every finished job is on the changed list */
+        for (job_t *job = changed_head, *nx; job; job = nx) {
+            nx = job->cnext;
+            if (job->state == JOB_DONE) remove_job(job);
+        }
+    }
+    if (sigint_seen) status = 130;
+    catch_sigint(0);
+    return status;
+}
+
+/*
+ * BUILTIN: hash - INSPECT/RESET THE PATH CACHE
+ * 
+ * hash:          List cached commands with hit counts
+ * hash -r:       Forget everything (e.g. after installing a binary)
+ * hash cmd...:   Look up and remember cmd
+ */
+static int builtin_hash(command_t *cmd) {
+    if (cmd->argc == 1) {
+        int any = 0;
+        for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (path_entry_t *e = path_cache[i]; e; e = e->next) {
+                if (!e->path) continue;
+                if (!any) printf("hits\tcommand\n");
+                any = 1;
+                printf("%4d\t%s\n", e->hits, e->path);
+            }
+        }
+        if (!any) printf("hash: hash table empty\n");
+        return 0;
+    }
+    
+    int status = 0;
+    for (int i = 1; i < cmd->argc; i++) {
+        if (strcmp(cmd->args[i], "-r") == 0) {
+            path_cache_clear();
+            bin_cache_clear();
+        } else if (!find_in_path(cmd->args[i])) {
+            fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * BUILTIN: set - SHELL OPTIONS
+ * 
+ * set:            List shell variables
+ * set -o / +o:    List options and their state
+ * set -o NAME:    Enable option
+ * set +o NAME:    Disable option
+ * 
+ * Options can also be enabled at startup through the environment:
+ *   SHELLOPTS=zygote mysh
+ * (init_shell() applies them before the shell has done any work,
+ * which is when the zygote is cheapest to fork).
+ */
+static int apply_zygote(int on) {
+    if (!on) {
+        zygote_stop();
+        return 0;
+    }
+    if (zygote_start() < 0) {
+        perror("set: zygote");
+        return -1;
+    }
+    return 0;
+}
+
+static int apply_cgroups(int on) {
+    if (!on) {
+        cg_stop();
+        return 0;
+    }
+    if (cg_start() < 0) {
+        perror("set: cgroups: no delegated cgroup v2 subtree");
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int *flag;
+    int (*apply)(int on);     /* NULL: flag only */
+} shell_option_t;
+
+static const shell_option_t shell_options[] = {
+    { "zygote", &opt_zygote, apply_zygote },
+    { "cgroups", &opt_cgroups, apply_cgroups },
+    { NULL, NULL, NULL }
+};
+
+static int set_option(const char *name, int on) {
+    for (const shell_option_t *o = shell_options; o->name; o++) {
+        if (strcmp(o->name, name) != 0) continue;
+        if (o->apply && o->apply(on) < 0) return 1;
+        *o->flag = on;
+        return 0;
+    }
+    fprintf(stderr, "set: %s: invalid option name\n", name);
+    return 1;
+}
+
+static int builtin_set(command_t *cmd) {
+    if (cmd->argc == 1) {
+        for (int i = 0; i < nvars; i++) {
+            printf("%s=%s\n", vars[i].name, vars[i].value);
+        }
+        return 0;
+    }
+    
+    int status = 0;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *arg = cmd->args[i];
+        if (strcmp(arg, "-o") != 0 && strcmp(arg, "+o") != 0) {
+            fprintf(stderr, "set: %s: invalid option\n", arg);
+            status = 1;
+            continue;
+        }
+        if (i + 1 < cmd->argc) {
+            status |= set_option(cmd->args[++i], arg[0] == '-');
+            continue;
+        }
+        for (const shell_option_t *o = shell_options; o->name; o++) {
+            printf("%-15s %s\n", o->name, *o->flag ? "on" : "off");
+        }
+    }
+    return status;
+}
+
+/*
+ * BUILTINS: echo, printf, true, false, : - NO PROCESS AT ALL
+ * 
+ * Log-heavy scripts are mostly echo. As an external command each
+ * one costs spawn + execve (dynamic loader, libc init) + exit + reap
+ * for a few bytes of output. In the shell it is one system call:
+ * 
+ *   writev(fd, iov, iovcnt) - syscall
+ *   ----------------------------------
+ *     Gathers several buffers into one write; the kernel copies them
+ *     in order, atomically for pipes up to PIPE_BUF.
+ *     echo a b c → iov = { "a", " ", "b", " ", "c", "\n" }
+ *     Arguments are written straight from argv, no copy.
+ * 
+ * stdio is flushed first so earlier buffered output stays in order.
+ * Inside a pipeline stage that runs in the shell, stdout is a memory
+ * stream with no fd (see run_builtin_stage()); output goes through
+ * fwrite() there instead.
+ * 
+ * echo [-neE] args:  -n no newline, -e interpret \n \t \\ \0NNN ...
+ *                    (\c stops all output), -E don't (default)
+ * printf fmt args:   %d %i %u %o %x %X %f %e %g %c %s %b %%, flags, width,
+ *                    precision; fmt is reused until args run out
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} outbuf_t;
+
+static outbuf_t builtin_buf;
+
+static void out_add(outbuf_t *o, const char *s, size_t n) {
+    if (n == 0) return;
+    if (o->len + n > o->cap) {
+        o->cap = (o->len + n) * 2 + 256;
+        o->data = realloc(o->data, o->cap);
+        if (!o->data) die("realloc");
+    }
+    memcpy(o->data + o->len, s, n);
+    o->len += n;
+}
+
+/* Writes iov[iovcnt], which it uses up (short writes advance it) */
+static int builtin_emit(struct iovec *iov, int iovcnt) {
+    int fd = fileno(stdout);
+    if (fd < 0) {
+        for (int i = 0; i < iovcnt; i++) {
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+        }
+        return 0;
+    }
+    
+    fflush(stdout);
+    struct iovec *p = iov;
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, p, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("write");
+            return 1;
+        }
+        /* Short write (pipe full, signal): resume where it stopped */
+        while (iovcnt > 0 && (size_t)n >= p->iov_len) {
+            n -= p->iov_len;
+            p++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            p->iov_base = (char *)p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Backslash escapes (echo -e, printf format and %b).
+ * Returns 1 if \c was seen: caller stops all output.
+ */
+static int out_escapes(outbuf_t *o, const char *s, size_t n) {
+    const char *end = s + n;
+    while (s < end) {
+        const char *bs = memchr(s, '\\', end - s);
+        if (!bs) bs = end;
+        out_add(o, s, bs - s);
+        if (bs >= end - 1) {
+            if (bs == end - 1) out_add(o, "\\", 1);
+            return 0;
+        }
+        s = bs + 2;
+        char c;
+        switch (bs[1]) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'e': c = 033; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case '\\': c = '\\'; break;
+        case 'c': return 1;
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7': {
+            /* \0NNN (echo) and \NNN (printf): up to 3 octal digits */
+            const char *d = bs[1] == '0' ? bs + 2 : bs + 1;
+            int v = 0;
+            for (int k = 0; k < 3 && d < end && *d >= '0' && *d <= '7'; k++) {
+                v = v * 8 + (*d++ - '0');
+            }
+            s = d;
+            c = (char)v;
+            break;
+        }
+        default:
+            out_add(o, bs, 2);
+            continue;
+        }
+        out_add(o, &c, 1);
+    }
+    return 0;
+}
+
+static int builtin_echo(command_t *cmd) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+    
+    /* Option words: only [-neE]+, anything else is text ("-x" → "-x") */
+    for (; i < cmd->argc && cmd->args[i][0] == '-' && cmd->args[i][1]; i++) {
+        const char *f = cmd->args[i] + 1;
+        if (strspn(f, "neE") != strlen(f)) break;
+        for (; *f; f++) {
+            if (*f == 'n') newline = 0;
+            else escapes = *f == 'e';
+        }
+    }
+    
+    if (escapes) {
+        outbuf_t *o = &builtin_buf;
+        o->len = 0;
+        int stop = 0;
+        for (int j = i; j < cmd->argc && !stop; j++) {
+            if (j > i) out_add(o, " ", 1);
+            stop = out_escapes(o, cmd->args[j], strlen(cmd->args[j]));
+        }
+        if (newline && !stop) out_add(o, "\n", 1);
+        struct iovec v = { o->data, o->len };
+        return builtin_emit(&v, 1);
+    }
+    
+    /* Kept from call to call: as many as the longest echo needed */
+    static struct iovec *iov;
+    static int iov_cap;
+    if (2 * cmd->argc + 1 > iov_cap) {
+        iov_cap = 2 * cmd->argc + 1;
+        iov = realloc(iov, iov_cap * sizeof(*iov));
+        if (!iov) die("realloc");
+    }
+    int n = 0;
+    for (int j = i; j < cmd->argc; j++) {
+        if (j > i) iov[n++] = (struct iovec){ " ", 1 };
+        iov[n++] = (struct iovec){ cmd->args[j], strlen(cmd->args[j]) };
+    }
+    if (newline) iov[n++] = (struct iovec){ "\n", 1 };
+    return builtin_emit(iov, n);
+}
+
+/*
+ * printf FORMAT CACHE
+ * 
+ * A script's printf calls use a handful of formats, millions of
+ * times ("printf '%s\t%d\n' ..." in a loop). Parsing (escapes,
+ * flags, width, precision) is done once per format string and kept:
+ * 
+ *   "x=%5d\n"  →  { lit "x=", conv "%5lld" } { lit "\n", none }
+ * 
+ * Each segment is literal text (escapes already applied) followed by
+ * at most one conversion, stored as a ready-made snprintf() spec;
+ * as many as the format has. PRINTF_CACHE_SIZE formats, replaced
+ * round-robin.
+ */
+#define PRINTF_CACHE_SIZE 16
+
+typedef struct {
+    size_t lit;                    /* Offset of literal text in lits */
+    size_t litlen;
+    char spec[24];                 /* snprintf() spec, "" if none */
+    char conv;                     /* d i u o x X f e g c s b, 0: none */
+} printf_seg_t;
+
+typedef struct {
+    char *fmt;                     /* NULL: slot free */
+    char *lits;
+    printf_seg_t *segs;
+    int nsegs;
+    int segs_cap;
+    int nconv;
+    int stop;                      /* Format contains \c */
+    char bad;                      /* Invalid directive, 0 if none */
+} printf_fmt_t;
+
+static printf_fmt_t printf_cache[PRINTF_CACHE_SIZE];
+static int printf_cache_next;
+
+static printf_fmt_t *printf_parse(const char *fmt) {
+    for (int i = 0; i < PRINTF_CACHE_SIZE; i++) {
+        if (printf_cache[i].fmt && strcmp(printf_cache[i].fmt, fmt) == 0) {
+            return &printf_cache[i];
+        }
+    }
+    
+    printf_fmt_t *f = &printf_cache[printf_cache_next];
+    printf_cache_next = (printf_cache_next + 1) % PRINTF_CACHE_SIZE;
+    free(f->fmt);
+    free(f->lits);
+    printf_seg_t *segs = f->segs;  /* Kept: reused by the next format */
+    int segs_cap = f->segs_cap;
+    memset(f, 0, sizeof(*f));
+    f->fmt = strdup(fmt);
+    f->segs = segs;
+    f->segs_cap = segs_cap;
+    
+    outbuf_t lits = { NULL, 0, 0 };
+    const char *p = fmt;
+    while (*p) {
+        if (f->nsegs == f->segs_cap) {
+            f->segs_cap = f->segs_cap ? f->segs_cap * 2 : 8;
+            f->segs = realloc(f->segs, f->segs_cap * sizeof(*f->segs));
+            if (!f->segs) die("realloc");
+        }
+        printf_seg_t *seg = &f->segs[f->nsegs++];
+        memset(seg, 0, sizeof(*seg));
+        
+        /* Literal run up to the next conversion ("%%" is literal) */
+        seg->lit = lits.len;
+        while (*p && !f->stop) {
+            const char *pct = strchr(p, '%');
+            if (!pct) pct = p + strlen(p);
+            f->stop = out_escapes(&lits, p, pct - p);
+            p = pct;
+            if (p[0] == '%' && p[1] == '%') {
+                out_add(&lits, "%", 1);
+                p += 2;
+                continue;
+            }
+            break;
+        }
+        seg->litlen = lits.len - seg->lit;
+        if (f->stop || !*p) break;
+        
+        /* %[flags][width][.precision]conv */
+        const char *start = p++;
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if (*p == '.') {
+            p++;
+            p += strspn(p, "0123456789");
+        }
+        if (!*p || !strchr("diuoxXfFeEgGcsb", *p) ||
+            (size_t)(p - start) > sizeof(seg->spec) - 4) {
+            f->bad = *p ? *p : '%';
+            break;
+        }
+        seg->conv = *p;
+        int len = p - start;
+        if (strchr("di", *p)) {
+            snprintf(seg->spec, sizeof(seg->spec), "%.*slld", len, start);
+        } else if (strchr("uoxX", *p)) {
+            snprintf(seg->spec, sizeof(seg->spec), "%.*sll%c", len, start, *p);
+        } else if (strchr("fFeEgG", *p)) {
+            snprintf(seg->spec, sizeof(seg->spec), "%.*s%c", len, start, *p);
+        } else {
+            /* c → s of a 1-char string, b → s of the expanded string */
+            snprintf(seg->spec, sizeof(seg->spec), "%.*ss", len, start);
+        }
+        f->nconv++;
+        p++;
+    }
+    
+    f->lits = lits.data;
+    return f;
+}
+
+/* Numeric argument: decimal, 0octal, 0xhex, or 'c / "c (char code) */
+static long long printf_number(const char *arg, int *status) {
+    if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+    
+    char *end;
+    errno = 0;
+    long long v = strtoll(arg, &end, 0);
+    if (*arg && (*end || errno)) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return v;
+}
+
+static void out_format(outbuf_t *o, const char *spec, ...) {
+    va_list ap;
+    va_start(ap, spec);
+    int n = vsnprintf(NULL, 0, spec, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    
+    if (o->len + n + 1 > o->cap) {
+        o->cap = (o->len + n + 1) * 2;
+        o->data = realloc(o->data, o->cap);
+        if (!o->data) die("realloc");
+    }
+    va_start(ap, spec);
+    vsnprintf(o->data + o->len, n + 1, spec, ap);
+    va_end(ap);
+    o->len += n;
+}
+
+static int builtin_printf(command_t *cmd) {
+    if (cmd->argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    
+    printf_fmt_t *f = printf_parse(cmd->args[1]);
+    outbuf_t *o = &builtin_buf;
+    o->len = 0;
+    int status = 0;
+    int a = 2;
+    int stop = 0;
+    
+    do {
+        for (int i = 0; i < f->nsegs && !stop; i++) {
+            printf_seg_t *seg = &f->segs[i];
+            out_add(o, f->lits + seg->lit, seg->litlen);
+            if (!seg->conv) continue;
+            
+            const char *arg = a < cmd->argc ? cmd->args[a++] : "";
+            switch (seg->conv) {
+            case 'd': case 'i':
+                out_format(o, seg->spec, printf_number(arg, &status));
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                out_format(o, seg->spec,
+                           (unsigned long long)printf_number(arg, &status));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
+                char *end;
+                double d = strtod(arg, &end);
+                if (*arg && *end) {
+                    fprintf(stderr, "printf: %s: invalid number\n", arg);
+                    status = 1;
+                }
+                out_format(o, seg->spec, d);
+                break;
+            }
+            case 'c': {
+                char c[2] = { arg[0], '\0' };
+                out_format(o, seg->spec, c);
+                break;
+            }
+            case 's':
+                out_format(o, seg->spec, arg);
+                break;
+            case 'b': {
+                outbuf_t b = { NULL, 0, 0 };
+                stop = out_escapes(&b, arg, strlen(arg));
+                out_add(&b, "", 1);
+                out_format(o, seg->spec, b.data);
+                free(b.data);
+                break;
+            }
+            }
+        }
+        stop |= f->stop;
+    } while (!stop && !f->bad && f->nconv > 0 && a < cmd->argc);
+    
+    if (f->bad) {
+        fprintf(stderr, "printf: %%%c: invalid directive\n", f->bad);
+        status = 1;
+    }
+    
+    struct iovec v = { o->data, o->len };
+    if (builtin_emit(&v, 1)) status = 1;
+    return status;
+}
+
+static int builtin_true(command_t *cmd) {
+    (void)cmd;
+    return 0;
+}
+
+static int builtin_false(command_t *cmd) {
+    (void)cmd;
+    return 1;
+}
+
+/*
+ * BUILTIN: test / [ - CONDITIONALS WITHOUT A PROCESS
+ * 
+ * [ -f x ] as /usr/bin/[ is spawn + execve + exit + reap to learn one
+ * bit. In the shell it is one statx() (or nothing, for strings).
+ * 
+ * POSIX operators:
+ *   Files:    -e -f -d -s -r -w -x -b -c -p -S -h -L -g -u -k
+ *             f1 -nt f2, f1 -ot f2, f1 -ef f2
+ *   Strings:  -n s, -z s, s, s1 = s2, s1 != s2
+ *   Integers: -eq -ne -lt -le -gt -ge
+ *   Logic:    ! expr, expr -a expr, expr -o expr, ( expr )
+ * With 1-4 arguments POSIX fixes the meaning by argument count
+ * ("[ ! = ]" compares strings); longer expressions are parsed with
+ * the usual precedence: ! binds tightest, then -a, then -o.
+ * 
+ * -r/-w/-x use faccessat(AT_EACCESS): permission for the effective
+ * uid, ACLs and read-only mounts included, which mode bits can't tell.
+ * 
+ * statx() - syscall (Linux 4.11)
+ * -------------------------------
+ *   stat() with a mask of wanted fields; the filesystem may skip the
+ *   rest (no i_size/timestamp refresh on network filesystems).
+ * 
+ * STAT CACHE - one statx() per path per command (pipeline)
+ *   [ -e f -a -f f -a -s f ]  →  1 statx() instead of 3
+ * Results (including ENOENT) are kept per (path, follow symlinks)
+ * and dropped before each pipeline runs (run_node()), so nothing done
+ * by an earlier command is ever hidden, even on the same line:
+ * "touch x; [ -f x ]" stats x afresh.
+ */
+#define STAT_CACHE_SIZE 8
+
+typedef struct {
+    char *path;
+    int follow;                    /* 0: lstat semantics (-h, -L) */
+    int ok;
+    struct statx stx;
+} stat_entry_t;
+
+static stat_entry_t stat_cache[STAT_CACHE_SIZE];
+static int nstat_cache;
+
+static void stat_cache_clear(void) {
+    for (int i = 0; i < nstat_cache; i++) {
+        free(stat_cache[i].path);
+    }
+    nstat_cache = 0;
+}
+
+static struct statx *test_stat(const char *path, int follow) {
+    static stat_entry_t spill;     /* Cache full: not remembered */
+    
+    for (int i = 0; i < nstat_cache; i++) {
+        stat_entry_t *e = &stat_cache[i];
+        if (e->follow == follow && strcmp(e->path, path) == 0) {
+            return e->ok ? &e->stx : NULL;
+        }
+    }
+    
+    stat_entry_t *e = nstat_cache < STAT_CACHE_SIZE ?
+                      &stat_cache[nstat_cache++] : &spill;
+    if (e != &spill) e->path = strdup(path);
+    e->follow = follow;
+    e->ok = statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW,
+                  STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE |
+                  STATX_MTIME, &e->stx) == 0;
+    return e->ok ? &e->stx : NULL;
+}
+
+typedef struct {
+    char **args;
+    int n;
+    int pos;
+    int error;
+} test_t;
+
+static int test_error(test_t *t, const char *what, const char *arg) {
+    if (!t->error) fprintf(stderr, "test: %s%s%s\n", arg ? arg : "",
+                           arg ? ": " : "", what);
+    t->error = 1;
+    return 0;
+}
+
+static int is_unary_op(const char *s) {
+    return s[0] == '-' && s[1] && !s[2] && strchr("efdsrwxbcpShLgukntz", s[1]);
+}
+
+static int is_binary_op(const char *s) {
+    static const char *ops[] = {
+        "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL
+    };
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(s, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static long long test_int(test_t *t, const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == s || *end || errno) test_error(t, "integer expression expected", s);
+    return v;
+}
+
+static int test_unary(test_t *t, char op, const char *arg) {
+    struct statx *st;
+    switch (op) {
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 't': return isatty((int)test_int(t, arg));
+    case 'r': return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+    case 'w': return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+    case 'x': return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    case 'h':
+    case 'L':
+        st = test_stat(arg, 0);
+        return st && S_ISLNK(st->stx_mode);
+    }
+    
+    st = test_stat(arg, 1);
+    if (!st) return 0;
+    switch (op) {
+    case 'e': return 1;
+    case 'f': return S_ISREG(st->stx_mode);
+    case 'd': return S_ISDIR(st->stx_mode);
+    case 's': return st->stx_size > 0;
+    case 'b': return S_ISBLK(st->stx_mode);
+    case 'c': return S_ISCHR(st->stx_mode);
+    case 'p': return S_ISFIFO(st->stx_mode);
+    case 'S': return S_ISSOCK(st->stx_mode);
+    case 'g': return (st->stx_mode & S_ISGID) != 0;
+    case 'u': return (st->stx_mode & S_ISUID) != 0;
+    case 'k': return (st->stx_mode & S_ISVTX) != 0;
+    }
+    return 0;
+}
+
+static int test_mtime_cmp(struct statx *a, struct statx *b) {
+    if (a->stx_mtime.tv_sec != b->stx_mtime.tv_sec) {
+        return a->stx_mtime.tv_sec < b->stx_mtime.tv_sec ? -1 : 1;
+    }
+    if (a->stx_mtime.tv_nsec != b->stx_mtime.tv_nsec) {
+        return a->stx_mtime.tv_nsec < b->stx_mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+static int test_binary(test_t *t, const char *l, const char *op, const char *r) {
+    if (strcmp(op, "=") == 0) return strcmp(l, r) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(l, r) != 0;
+    
+    if (op[1] == 'n' || op[1] == 'o' || strcmp(op, "-ef") == 0) {
+        struct statx a, b;
+        struct statx *sa = test_stat(l, 1);
+        if (sa) a = *sa;           /* Copy: second lookup may spill */
+        struct statx *sb = test_stat(r, 1);
+        if (sb) b = *sb;
+        if (strcmp(op, "-ef") == 0) {
+            return sa && sb && a.stx_ino == b.stx_ino &&
+                   a.stx_dev_major == b.stx_dev_major &&
+                   a.stx_dev_minor == b.stx_dev_minor;
+        }
+        /* A missing file is older than any existing one */
+        if (strcmp(op, "-nt") == 0) return sa && (!sb || test_mtime_cmp(&a, &b) > 0);
+        return sb && (!sa || test_mtime_cmp(&a, &b) < 0);
+    }
+    
+    long long a = test_int(t, l), b = test_int(t, r);
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+static int test_or(test_t *t);
+
+/* primary: ( expr ) | unary-op arg | arg binary-op arg | arg */
+static int test_primary(test_t *t) {
+    char **a = t->args + t->pos;
+    int left = t->n - t->pos;
+    
+    if (left <= 0) return test_error(t, "argument expected", NULL);
+    
+    if (left >= 3 && is_binary_op(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "(") == 0) {
+        t->pos++;
+        int v = test_or(t);
+        if (t->pos >= t->n || strcmp(t->args[t->pos], ")") != 0) {
+            return test_error(t, "')' expected", NULL);
+        }
+        t->pos++;
+        return v;
+    }
+    if (left >= 2 && is_unary_op(a[0])) {
+        t->pos += 2;
+        return test_unary(t, a[0][1], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static int test_not(test_t *t) {
+    if (t->pos < t->n && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(test_t *t) {
+    int v = test_not(t);
+    while (t->pos < t->n && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        v = test_not(t) && v;
+    }
+    return v;
+}
+
+static int test_or(test_t *t) {
+    int v = test_and(t);
+    while (t->pos < t->n && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        v = test_and(t) || v;
+    }
+    return v;
+}
+
+/* POSIX: the meaning of 1-4 arguments depends on their number */
+static int test_expr(test_t *t, char **args, int n) {
+    switch (n) {
+    case 0:
+        return 0;
+    case 1:
+        return args[0][0] != '\0';
+    case 2:
+        if (strcmp(args[0], "!") == 0) return !test_expr(t, args + 1, 1);
+        if (is_unary_op(args[0])) return test_unary(t, args[0][1], args[1]);
+        return test_error(t, "unary operator expected", args[0]);
+    case 3:
+        if (is_binary_op(args[1])) return test_binary(t, args[0], args[1], args[2]);
+        if (strcmp(args[1], "-a") == 0) return args[0][0] && args[2][0];
+        if (strcmp(args[1], "-o") == 0) return args[0][0] || args[2][0];
+        if (strcmp(args[0], "!") == 0) return !test_expr(t, args + 1, 2);
+        if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+            return test_expr(t, args + 1, 1);
+        }
+        return test_error(t, "binary operator expected", args[1]);
+    case 4:
+        if (strcmp(args[0], "!") == 0) return !test_expr(t, args + 1, 3);
+        if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) {
+            return test_expr(t, args + 1, 2);
+        }
+        break;
+    }
+    
+    t->args = args;
+    t->n = n;
+    t->pos = 0;
+    int v = test_or(t);
+    if (t->pos < t->n) test_error(t, "too many arguments", t->args[t->pos]);
+    return v;
+}
+
+static int builtin_test(command_t *cmd) {
+    int n = cmd->argc - 1;
+    if (strcmp(cmd->args[0], "[") == 0) {
+        if (n < 1 || strcmp(cmd->args[n], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        n--;
+    }
+    
+    test_t t = { NULL, 0, 0, 0 };
+    int v = test_expr(&t, cmd->args + 1, n);
+    return t.error ? 2 : !v;
+}
+
+/*
+ * BUILTIN: cat - ZERO-COPY CONCATENATION
+ * 
+ * An external cat copies every byte twice: read() kernel → user
+ * buffer, write() user buffer → kernel. The kernel can move the data
+ * itself; which syscall depends on what the fds are:
+ * 
+ *   in → out          syscall            data path
+ *   file → file       copy_file_range()  page cache → page cache,
+ *                                        or reflink/server-side copy
+ *                                        (btrfs, xfs, NFS 4.2)
+ *   any  → pipe       splice()           file pages referenced by
+ *   pipe → any                           the pipe buffer, no copy
+ *   file → other      sendfile()         page cache → socket/tty
+ *   anything else     read()/write()     64 KiB buffer
+ * 
+ * Each fast path falls back to read()/write() when the kernel says
+ * the pair isn't supported (EINVAL, EXDEV, ENOSYS, EOPNOTSUPP, e.g.
+ * splice() into an O_APPEND file). Offsets are the fds' own (NULL
+ * offset arguments), so a fallback resumes exactly where it stopped.
+ * 
+ * Where it runs:
+ *   cat a b > c         in the shell, if every operand is a regular
+ *                       file and the output isn't a terminal (the
+ *                       shell ignores ^C and ^Z: an endless
+ *                       "cat /dev/zero", or a huge log scrolling by,
+ *                       must be a child they can reach)
+ *   cat f | cmd         on a thread, writing into the stage's pipe
+ *   ... | cat | cmd     (see run_cat_stage()), foreground jobs only
+ *   anything else       forked child running this same code
+ */
+#define CAT_CHUNK (1 << 30)
+
+static int cat_fallback(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Copy in → out until EOF. 0, or errno of the failure. */
+static int cat_copy(int in, int out) {
+    char buf[64 * 1024];
+    struct stat si, so;
+    ssize_t n;
+    
+    if (fstat(in, &si) < 0 || fstat(out, &so) < 0) return errno;
+    
+    if (S_ISREG(si.st_mode) && S_ISREG(so.st_mode)) {
+        while ((n = copy_file_range(in, NULL, out, NULL, CAT_CHUNK, 0)) > 0) {}
+        if (n == 0) return 0;
+        if (!cat_fallback(errno)) return errno;
+    } else if (S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode)) {
+        while ((n = splice(in, NULL, out, NULL, CAT_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {}
+        if (n == 0) return 0;
+        if (!cat_fallback(errno)) return errno;
+    } else if (S_ISREG(si.st_mode)) {
+        while ((n = sendfile(out, in, NULL, CAT_CHUNK)) > 0) {}
+        if (n == 0) return 0;
+        if (!cat_fallback(errno)) return errno;
+    }
+    
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return errno;
+            off += w;
+        }
+    }
+    return 0;
+}
+
+/* cat [-u] [file...] from `in` (for "-" / no operands) to `out` */
+static int cat_files(char **files, int nfiles, int in, int out) {
+    int status = 0;
+    struct stat so;
+    int out_reg = fstat(out, &so) == 0 && S_ISREG(so.st_mode);
+    
+    for (int i = 0; i < nfiles || (i == 0 && nfiles == 0); i++) {
+        const char *name = nfiles ? files[i] : "-";
+        int fd = strcmp(name, "-") == 0 ? in : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+        
+        /* "cat f >> f" would never reach EOF */
+        struct stat si;
+        if (out_reg && fstat(fd, &si) == 0 && si.st_dev == so.st_dev &&
+            si.st_ino == so.st_ino && S_ISREG(si.st_mode)) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            status = 1;
+        } else {
+            int err = cat_copy(fd, out);
+            if (err && err != EPIPE) {
+                fprintf(stderr, "cat: %s: %s\n", name, strerror(err));
+                status = 1;
+            }
+        }
+        if (fd != in) close(fd);
+    }
+    return status;
+}
+
+static int builtin_cat(command_t *cmd) {
+    int i = 1;
+    if (i < cmd->argc && strcmp(cmd->args[i], "-u") == 0) i++;  /* Unbuffered anyway */
+    fflush(stdout);
+    return cat_files(cmd->args + i, cmd->argc - i, STDIN_FILENO, STDOUT_FILENO);
+}
+
+/* May this builtin run inside the shell process, outside a pipeline? */
+static int builtin_in_shell_ok(command_t *cmd) {
+    if (strcmp(cmd->args[0], "cat") != 0) return 1;
+    
+    /* Output: the last redirection of fd 1 wins, else the shell's */
+    const char *out = NULL;
+    for (int j = 0; j < cmd->nredirects; j++) {
+        if (cmd->redirects[j].fd == STDOUT_FILENO) out = cmd->redirects[j].file;
+    }
+    struct stat so;
+    if (out ? stat(out, &so) == 0 && S_ISCHR(so.st_mode) : isatty(STDOUT_FILENO)) {
+        return 0;                              /* A terminal, likely */
+    }
+    
+    int i = 1;
+    if (i < cmd->argc && strcmp(cmd->args[i], "-u") == 0) i++;
+    if (i == cmd->argc) return 0;              /* Reads stdin */
+    for (; i < cmd->argc; i++) {
+        struct stat st;
+        if (stat(cmd->args[i], &st) < 0) continue;  /* Just an error */
+        if (!S_ISREG(st.st_mode)) return 0;
+    }
+    return 1;
+}
+
+/*
+ * BUILTIN: read [-r] [name...] - ONE LINE INTO VARIABLES
+ * 
+ * POSIX: read must not consume input past the newline, because the
+ * next command (or the next read) reads the same fd:
+ * 
+ *   read a; cat          cat must see line 2 onwards
+ * 
+ * How many bytes can be requested depends on the fd type:
+ *   Pipe, tty, socket:  no way to push data back → read(fd, &c, 1),
+ *                       one syscall per byte
+ *   Regular file:       read a 64 KiB block, find the newline, then
+ *                       lseek(fd, -unused, SEEK_CUR) to give the rest
+ *                       back: 2 syscalls per line instead of ~80
+ *   The shell's own input (script on stdin, terminal): the line comes
+ *                       from read_line(), which already holds it
+ * 
+ * Without -r, backslash quotes the next character and "\<newline>"
+ * continues the line. Splitting follows $IFS (default " \t\n"): IFS
+ * whitespace around fields is trimmed, other IFS characters delimit
+ * exactly one field, the last name gets the rest of the line.
+ * No names: the whole line goes to $REPLY unsplit.
+ * 
+ * Exit status 1 at end of file (names still get a partial line).
+ */
+#define READ_BLOCK (64 * 1024)
+
+typedef struct {
+    char *data;
+    char *quoted;                  /* 1: escaped, never a separator */
+    size_t len;
+    size_t cap;
+} read_line_t;
+
+static void read_add(read_line_t *l, char c, char quoted) {
+    if (l->len + 1 >= l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->data = realloc(l->data, l->cap);
+        l->quoted = realloc(l->quoted, l->cap);
+        if (!l->data || !l->quoted) die("realloc");
+    }
+    l->data[l->len] = c;
+    l->quoted[l->len++] = quoted;
+}
+
+/*
+ * Next raw line of fd 0 (newline stripped) into *out.
+ * Returns 1 if a newline ended it, 0 at EOF.
+ */
+static int read_raw_line(outbuf_t *out) {
+    out->len = 0;
+    
+    if (stdin_is_input) {
+        int nl;
+        char *line = read_line(0, &nl);
+        if (!line) return 0;
+        out_add(out, line, strlen(line));
+        return nl;
+    }
+    
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        char buf[READ_BLOCK];
+        for (;;) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return 0;
+            char *nl = memchr(buf, '\n', n);
+            if (!nl) {
+                out_add(out, buf, n);
+                continue;
+            }
+            out_add(out, buf, nl - buf);
+            /* Hand back what belongs to the next reader */
+            lseek(STDIN_FILENO, -(off_t)(n - (nl - buf) - 1), SEEK_CUR);
+            return 1;
+        }
+    }
+    
+    for (;;) {
+        char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        if (c == '\n') return 1;
+        out_add(out, &c, 1);
+    }
+}
+
+static int builtin_read(command_t *cmd) {
+    int raw = 0;
+    int i = 1;
+    for (; i < cmd->argc && cmd->args[i][0] == '-'; i++) {
+        if (strcmp(cmd->args[i], "-r") == 0) {
+            raw = 1;
+        } else if (strcmp(cmd->args[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            fprintf(stderr, "read: %s: invalid option\n", cmd->args[i]);
+            return 2;
+        }
+    }
+    char **names = cmd->args + i;
+    int nnames = cmd->argc - i;
+    
+    fflush(stdout);
+    
+    /* Collect the logical line: raw lines joined by "\<newline>" */
+    outbuf_t *raw_line = &builtin_buf;
+    read_line_t l = { NULL, NULL, 0, 0 };
+    int got_nl;
+    for (;;) {
+        got_nl = read_raw_line(raw_line);
+        size_t j = 0;
+        int continued = 0;
+        for (; j < raw_line->len; j++) {
+            char c = raw_line->data[j];
+            if (!raw && c == '\\') {
+                if (j + 1 < raw_line->len) {
+                    read_add(&l, raw_line->data[++j], 1);
+                } else {
+                    continued = got_nl;  /* "\<newline>": next line */
+                }
+                continue;
+            }
+            read_add(&l, c, 0);
+        }
+        if (!continued) break;
+    }
+    read_add(&l, '\0', 0);
+    l.len--;
+    
+    if (nnames == 0) {
+        set_var("REPLY", l.data, 0);
+    } else {
+        const char *ifs = get_var("IFS");
+        if (!ifs) ifs = " \t\n";
+        #define IS_IFS(k) (!l.quoted[k] && l.data[k] && strchr(ifs, l.data[k]))
+        #define IS_IFS_WS(k) (IS_IFS(k) && isspace((unsigned char)l.data[k]))
+        
+        size_t p = 0;
+        while (p < l.len && IS_IFS_WS(p)) p++;
+        for (int k = 0; k < nnames; k++) {
+            size_t start = p, end;
+            if (k == nnames - 1) {
+                /* Last name: rest of the line, trailing IFS space cut */
+                end = l.len;
+                while (end > start && IS_IFS_WS(end - 1)) end--;
+                p = l.len;
+            } else {
+                while (p < l.len && !IS_IFS(p)) p++;
+                end = p;
+                while (p < l.len && IS_IFS_WS(p)) p++;
+                if (p < l.len && IS_IFS(p)) {
+                    p++;
+                    while (p < l.len && IS_IFS_WS(p)) p++;
+                }
+            }
+            char save = l.data[end];
+            l.data[end] = '\0';
+            set_var(names[k], l.data + start, 0);
+            l.data[end] = save;
+        }
+        #undef IS_IFS
+        #undef IS_IFS_WS
+    }
+    
+    free(l.data);
+    free(l.quoted);
+    return got_nl ? 0 : 1;
+}
+
+/*
+ * BUILTIN: parallel - FAN-OUT WITHOUT A HELPER PROCESS
+ * 
+ *   parallel [-j N] [-k] [--tag] cmd [args] ::: a b c
+ *   seq 100 | parallel -j 8 gzip -9 {}.log
+ * 
+ * Runs cmd once per argument, N at a time (default: online CPUs).
+ * "{}" in any word is replaced by the argument; without "{}" the
+ * argument is appended. Without ":::", arguments are lines of stdin.
+ * 
+ * Scheduler: a private epoll set holding, per running job, its pidfd
+ * (readable at exit) and the read end of its stdout pipe. One
+ * epoll_wait() serves both, so a slot is refilled the moment a job
+ * is done - no polling, no SIGCHLD, no sleeps.
+ * 
+ *        ┌────────── N slots ──────────┐
+ *   args │ job 7 │ job 8 │ job 9 │ ... │ ← launch while slots free
+ *        └──┬────────┬───────┬─────────┘
+ *     stdout pipe + pidfd per job → epoll_wait() → refill
+ * 
+ * Jobs go through the shell's own spawn path (spawn_stage(): zygote,
+ * vfork + cached binary fd, posix_spawn, fork fallback) as stage 0 of
+ * a two-stage pipeline whose pipe is the capture pipe.
+ * 
+ * Output is buffered per job and written when the job ends, so lines
+ * of concurrent jobs never interleave (stderr is passed through):
+ *   default:     in completion order
+ *   -k:          in argument order (finished jobs wait for earlier ones)
+ *   --tag:       each line prefixed with "arg<TAB>"
+ * 
+ * Jobs stay in the shell's process group, i.e. the foreground one:
+ * ^C reaches them (the shell ignores it) and parallel stops launching
+ * and exits 130 once the running ones are gone. A job stopped by ^Z
+ * is continued, since nothing could resume it later.
+ * 
+ * Not in the job table: the scheduler is the shell itself, running
+ * this builtin to completion, so its children can't be handed back
+ * to the prompt (fg, bg, ^Z) and no `jobs` or `wait` can run while
+ * they exist. Entering them in proc_hash would only let
+ * reap_events() collect exits the loop above is waiting for. The
+ * unit the table does track is the whole run: `parallel ... &` is a
+ * forked job like any other, seen by jobs, wait, fg and $!.
+ *
+ * Exit status: number of failed jobs (max 101), like GNU parallel.
+ */
+typedef struct {
+    char *arg;
+    pid_t pid;
+    int pidfd;
+    int outfd;
+    int status;
+    int exited;
+    outbuf_t out;
+} par_job_t;
+
+static void par_emit(par_job_t *j, int tag) {
+    outbuf_t *o = &j->out;
+    if (!tag) {
+        struct iovec v = { o->data, o->len };
+        if (o->len) builtin_emit(&v, 1);
+    } else {
+        outbuf_t t = { NULL, 0, 0 };
+        size_t alen = strlen(j->arg);
+        for (size_t p = 0; p < o->len; ) {
+            char *nl = memchr(o->data + p, '\n', o->len - p);
+            size_t end = nl ? (size_t)(nl - o->data) + 1 : o->len;
+            out_add(&t, j->arg, alen);
+            out_add(&t, "\t", 1);
+            out_add(&t, o->data + p, end - p);
+            p = end;
+        }
+        struct iovec v = { t.data, t.len };
+        if (t.len) builtin_emit(&v, 1);
+        free(t.data);
+    }
+    free(o->data);
+    o->data = NULL;
+    o->len = o->cap = 0;
+}
+
+/* argv for one job: "{}" substituted, or arg appended */
+static void par_argv(char **tmpl, int ntmpl, const char *arg, command_t *cmd) {
+    int used = 0;
+    size_t alen = strlen(arg);
+    
+    cmd->args = malloc((ntmpl + 2) * sizeof(*cmd->args));
+    if (!cmd->args) die("malloc");
+    cmd->argc = 0;
+    cmd->nredirects = 0;
+    for (int i = 0; i < ntmpl; i++) {
+        outbuf_t w = { NULL, 0, 0 };
+        const char *s = tmpl[i];
+        const char *hit;
+        while ((hit = strstr(s, "{}"))) {
+            out_add(&w, s, hit - s);
+            out_add(&w, arg, alen);
+            s = hit + 2;
+            used = 1;
+        }
+        out_add(&w, s, strlen(s) + 1);
+        cmd->args[cmd->argc++] = w.data;
+    }
+    if (!used) cmd->args[cmd->argc++] = strdup(arg);
+    cmd->args[cmd->argc] = NULL;
+}
+
+static int par_launch(par_job_t *j, char **tmpl, int ntmpl, int epfd, int id) {
+    static command_t cmds[2];
+    /* Stage 0 writes into pipes[0]; background: never takes the terminal */
+    pipeline_t pl = { cmds, 2, 0, 1, 0 };
+    int pipes[2][2];
+    
+    par_argv(tmpl, ntmpl, j->arg, &pl.cmds[0]);
+    
+    int ret = -1;
+    const char *path = is_builtin(pl.cmds[0].args[0]) ? NULL :
+                       find_in_path(pl.cmds[0].args[0]);
+    if (!path && !is_builtin(pl.cmds[0].args[0])) {
+        fprintf(stderr, "parallel: %s: command not found\n", pl.cmds[0].args[0]);
+        j->exited = 1;
+        j->status = 127;
+        j->outfd = -1;
+        goto out;
+    }
+    if (pipe2(pipes[0], O_CLOEXEC) < 0) goto out;
+    
+    pid_t pid = spawn_stage(&pl, 0, getpgrp(), pipes, path);
+    if (pid < 0) {
+        pid = fork();
+        if (pid == 0) exec_stage(&pl, 0, getpgrp(), pipes, path);
+    }
+    close(pipes[0][1]);
+    if (pid < 0) {
+        close(pipes[0][0]);
+        goto out;
+    }
+    
+    j->pid = pid;
+    j->outfd = pipes[0][0];
+    j->pidfd = pidfd_open(pid, 0);
+    
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.u64 = (uint64_t)id << 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, j->outfd, &ev);
+    if (j->pidfd >= 0) {
+        ev.data.u64 = (uint64_t)id << 1 | 1;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, j->pidfd, &ev);
+    }
+    ret = 0;
+out:
+    for (int i = 0; i < pl.cmds[0].argc; i++) free(pl.cmds[0].args[i]);
+    free(pl.cmds[0].args);
+    return ret;
+}
+
+/* Job's process reported: exit (done) or stop (continue it) */
+static void par_reap(par_job_t *j) {
+    siginfo_t si;
+    si.si_pid = 0;
+    if (j->pidfd >= 0) {
+        if (waitid(P_PIDFD, j->pidfd, &si, WEXITED | WSTOPPED | WNOHANG) < 0 ||
+            si.si_pid == 0) return;
+    } else if (waitid(P_PID, j->pid, &si, WEXITED) < 0) {
+        return;
+    }
+    
+    if (si.si_code == CLD_STOPPED) {
+        kill(j->pid, SIGCONT);
+        return;
+    }
+    j->exited = 1;
+    j->status = si.si_code == CLD_EXITED ? si.si_status : 128 + si.si_status;
+    if (j->pidfd >= 0) close(j->pidfd);
+    j->pidfd = -1;
+}
+
+static int builtin_parallel(command_t *cmd) {
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0, tag = 0;
+    int i = 1;
+    
+    for (; i < cmd->argc && cmd->args[i][0] == '-'; i++) {
+        const char *a = cmd->args[i];
+        if (strcmp(a, "-j") == 0 && i + 1 < cmd->argc) {
+            slots = atol(cmd->args[++i]);
+        } else if (strncmp(a, "-j", 2) == 0 && a[2]) {
+            slots = atol(a + 2);
+        } else if (strcmp(a, "-k") == 0 || strcmp(a, "--keep-order") == 0) {
+            keep_order = 1;
+        } else if (strcmp(a, "--tag") == 0) {
+            tag = 1;
+        } else {
+            fprintf(stderr, "parallel: %s: invalid option\n", a);
+            return 255;
+        }
+    }
+    if (slots < 1) slots = 1;
+    
+    char **tmpl = cmd->args + i;
+    int ntmpl = 0;
+    while (i + ntmpl < cmd->argc && strcmp(tmpl[ntmpl], ":::") != 0) ntmpl++;
+    if (ntmpl == 0) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-k] [--tag] "
+                        "cmd [args] [::: arg...]\n");
+        return 255;
+    }
+    
+    /* Arguments: after ":::", else one per stdin line */
+    int njobs_total = 0, cap = 64;
+    par_job_t *jobs_v = calloc(cap, sizeof(*jobs_v));
+    if (i + ntmpl < cmd->argc) {
+        for (int k = i + ntmpl + 1; k < cmd->argc; k++) {
+            if (njobs_total == cap) {
+                jobs_v = realloc(jobs_v, (cap *= 2) * sizeof(*jobs_v));
+            }
+            jobs_v[njobs_total++] = (par_job_t){ .arg = strdup(cmd->args[k]) };
+        }
+    } else {
+        outbuf_t line = { NULL, 0, 0 };
+        int more;
+        do {
+            more = read_raw_line(&line);
+            if (!more && line.len == 0) break;
+            if (njobs_total == cap) {
+                jobs_v = realloc(jobs_v, (cap *= 2) * sizeof(*jobs_v));
+            }
+            out_add(&line, "", 1);
+            jobs_v[njobs_total++] = (par_job_t){ .arg = strdup(line.data) };
+            line.len = 0;
+        } while (more);
+        free(line.data);
+    }
+    
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("parallel: epoll_create1");
+        return 255;
+    }
+    
+    int next = 0, running = 0, printed = 0, failed = 0, interrupted = 0;
+    fflush(stdout);
+    
+    while (next < njobs_total || running > 0) {
+        while (running < slots && next < njobs_total && !interrupted) {
+            par_job_t *j = &jobs_v[next];
+            if (par_launch(j, tmpl, ntmpl, epfd, next) == 0 && !j->exited) {
+                running++;
+            } else if (!j->exited) {
+                perror("parallel: launch");
+                j->exited = 1;
+                j->status = 255;
+                j->outfd = -1;
+            }
+            next++;
+        }
+        if (interrupted && running == 0) break;
+        
+        struct epoll_event evs[64];
+        int n = running > 0 ? epoll_wait(epfd, evs, 64, -1) : 0;
+        if (n < 0 && errno == EINTR) continue;
+        
+        for (int e = 0; e < n; e++) {
+            par_job_t *j = &jobs_v[evs[e].data.u64 >> 1];
+            if (evs[e].data.u64 & 1) {
+                par_reap(j);
+                continue;
+            }
+            char buf[16384];
+            ssize_t r = read(j->outfd, buf, sizeof(buf));
+            if (r > 0) {
+                out_add(&j->out, buf, r);
+            } else if (r == 0 || errno != EINTR) {
+                close(j->outfd);   /* Also leaves the epoll set */
+                j->outfd = -1;
+            }
+        }
+        
+        /* Finished: exited and stdout drained (pidfd-less: reap now) */
+        for (int k = printed; k < next; k++) {
+            par_job_t *j = &jobs_v[k];
+            if (j->pid > 0 && j->outfd < 0 && !j->exited) par_reap(j);
+            if (!j->exited || j->outfd >= 0 || j->pid < 0) continue;
+            
+            if (j->pid > 0) running--;
+            j->pid = -1;           /* Accounted */
+            if (j->status) failed++;
+            if (j->status == 128 + SIGINT) interrupted = 1;
+            if (!keep_order) par_emit(j, tag);
+        }
+        if (keep_order) {
+            while (printed < next && jobs_v[printed].pid < 0) {
+                par_emit(&jobs_v[printed++], tag);
+            }
+        } else {
+            while (printed < next && jobs_v[printed].pid < 0) printed++;
+        }
+    }
+    
+    close(epfd);
+    for (int k = 0; k < njobs_total; k++) {
+        free(jobs_v[k].arg);
+        free(jobs_v[k].out.data);
+    }
+    free(jobs_v);
+    
+    if (interrupted) return 130;
+    return failed > 101 ? 101 : failed;
+}
+
+/*
+ * BUILTIN: source / . - RUN A FILE IN THIS SHELL
+ * 
+ *   . ~/.myshrc
+ *   source lib/helpers.sh
+ *   source -s              cache statistics
+ *   source -r              forget every cached file
+ * 
+ * Each command runs as if typed: assignments, set -o, cd... all stay
+ * in effect. A name without '/' is looked up in $PATH (readable, need
+ * not be executable), then in the current directory.
+ * 
+ * Parsed-script cache
+ * -------------------
+ * rc files and helper libraries are sourced over and over. The file
+ * is read and parsed (parse_commands()) once; the trees are kept,
+ * keyed by what identifies the contents:
+ * 
+ *   (st_dev, st_ino, st_mtim, st_size)   from one fstat()
+ * 
+ * An unchanged file then costs open + fstat + close, and each command
+ * only the expansion pass. Editing the file changes mtime (and
+ * usually size), so the entry misses and is rebuilt; replacing it
+ * (mv new old, as editors do) changes the inode. Up to
+ * SOURCE_CACHE_SIZE files, least recently used evicted.
+ * 
+ * A script is reference-counted: the cache holds one reference and
+ * each running `source` another, so a file that re-sources itself
+ * after editing itself never frees the commands still being run.
+ */
+#define SOURCE_CACHE_SIZE 16
+#define SOURCE_MAX_DEPTH 64
+
+typedef struct {
+    char *text;            /* File contents; the trees point into it */
+    size_t len;
+    size_t maplen;         /* text is mmap()ed (script_map()), or 0 */
+    node_t **cmds;         /* One list per complete command */
+    int ncmds;
+    int cmds_cap;
+    arena_t arena;         /* The trees */
+    int refs;
+} script_t;
+
+static int parse_commands(script_t *s, size_t start, int recover);
+
+typedef struct {
+    char *path;            /* As resolved; for `source -s` only */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    script_t *script;      /* NULL = free slot */
+    unsigned hits;
+    unsigned long used;    /* LRU clock */
+} source_entry_t;
+
+static source_entry_t source_cache[SOURCE_CACHE_SIZE];
+static unsigned long source_clock;
+static unsigned long source_hits, source_misses;
+static int source_depth;
+
+static void script_clear(script_t *s) {
+    arena_reset(&s->arena);
+    s->ncmds = 0;
+}
+
+static void script_put(script_t *s) {
+    if (--s->refs > 0) return;
+    arena_free(&s->arena);
+    free(s->cmds);
+    if (s->maplen) munmap(s->text, s->maplen);
+    else free(s->text);
+    free(s);
+}
+
+/*
+ * Parse all of text[0..len); the trees point into text, which isn't
+ * modified. A "#!" first line is the kernel's, not ours, and is
+ * skipped; so is (after its message) the rest of a line with a
+ * syntax error.
+ */
+static script_t *script_parse(char *text, size_t len, size_t maplen) {
+    script_t *s = calloc(1, sizeof(*s));
+    s->text = text;
+    s->len = len;
+    s->maplen = maplen;
+    
+    size_t start = 0;
+    if (len >= 2 && text[0] == '#' && text[1] == '!') {
+        const char *nl = memchr(text, '\n', len);
+        start = nl ? (size_t)(nl - text) + 1 : len;
+    }
+    parse_commands(s, start, 1);
+    s->refs = 1;
+    return s;
+}
+
+/* Read all of fd into the heap (cached scripts outlive the file) */
+static script_t *script_compile(int fd) {
+    outbuf_t t = { NULL, 0, 0 };
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) out_add(&t, buf, n);
+    }
+    if (n < 0) {
+        free(t.data);
+        return NULL;
+    }
+    return script_parse(t.data, t.len, 0);
+}
+
+/*
+ * Map a regular file for one run (mysh script.sh): no read() copy,
+ * the page cache pages are the text, lexed and later expanded in
+ * place, never written.
+ * 
+ * As for any mapped file, truncating the script while it runs would
+ * fault (SIGBUS) on the pages cut off; editors replace files (a new
+ * inode), which leaves the mapping alone.
+ */
+static script_t *script_map(int fd, size_t size) {
+    char *text = NULL;
+    if (size > 0) {
+        text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) return NULL;
+        madvise(text, size, MADV_SEQUENTIAL);
+    }
+    return script_parse(text, size, size);
+}
+
+/* Run every command of s in this shell, as typed */
+static int script_run(script_t *s) {
+    int status = 0;
+    for (int i = 0; i < s->ncmds; i++) {
+        reap_events(0);
+        status = run_list(s->cmds[i]);
+    }
+    return status;
+}
+
+/* Cached parse of the open file, or a fresh one; caller gets a ref */
+static script_t *source_lookup(const char *path, int fd, const struct stat *st) {
+    source_entry_t *slot = NULL;
+    
+    for (int i = 0; i < SOURCE_CACHE_SIZE; i++) {
+        source_entry_t *e = &source_cache[i];
+        if (e->script && e->dev == st->st_dev && e->ino == st->st_ino) {
+            if (e->mtime.tv_sec == st->st_mtim.tv_sec &&
+                e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+                e->size == st->st_size) {
+                e->hits++;
+                e->used = ++source_clock;
+                source_hits++;
+                e->script->refs++;
+                return e->script;
+            }
+            slot = e;              /* Same file, changed: rebuild here */
+            break;
+        }
+        if (!slot || !e->script || (slot->script && e->used < slot->used)) slot = e;
+    }
+    
+    source_misses++;
+    script_t *s = script_compile(fd);
+    if (!s) return NULL;
+    
+    if (slot->script) script_put(slot->script);
+    free(slot->path);
+    slot->path = strdup(path);
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->mtime = st->st_mtim;
+    slot->size = st->st_size;
+    slot->script = s;
+    slot->hits = 0;
+    slot->used = ++source_clock;
+    s->refs++;
+    return s;
+}
+
+static void source_cache_clear(void) {
+    for (int i = 0; i < SOURCE_CACHE_SIZE; i++) {
+        source_entry_t *e = &source_cache[i];
+        if (e->script) script_put(e->script);
+        free(e->path);
+        memset(e, 0, sizeof(*e));
+    }
+}
+
+/* Name without '/': $PATH, then the current directory */
+static char *source_find(const char *name) {
+    const char *path = get_var("PATH");
+    struct stat st;
+    
+    while (!strchr(name, '/') && path && *path) {
+        size_t len = strcspn(path, ":");
+        char full[4096];
+        snprintf(full, sizeof(full), "%.*s/%s", (int)len, len ? path : ".", name);
+        if (access(full, R_OK) == 0 && stat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+            return strdup(full);
+        }
+        path += len + (path[len] == ':');
+    }
+    return strdup(name);
+}
+
+static int builtin_source(command_t *cmd) {
+    if (cmd->argc == 2 && strcmp(cmd->args[1], "-s") == 0) {
+        printf("hits\t cmds\tfile\n");
+        for (int i = 0; i < SOURCE_CACHE_SIZE; i++) {
+            source_entry_t *e = &source_cache[i];
+            if (!e->script) continue;
+            printf("%4u\t%5d\t%s\n", e->hits, e->script->ncmds, e->path);
+        }
+        printf("%lu hits, %lu misses\n", source_hits, source_misses);
+        return 0;
+    }
+    if (cmd->argc == 2 && strcmp(cmd->args[1], "-r") == 0) {
+        source_cache_clear();
+        return 0;
+    }
+    if (cmd->argc < 2) {
+        fprintf(stderr, "%s: filename argument required\n", cmd->args[0]);
+        return 2;
+    }
+    if (source_depth >= SOURCE_MAX_DEPTH) {
+        fprintf(stderr, "%s: %s: nested too deeply\n", cmd->args[0], cmd->args[1]);
+        return 1;
+    }
+    
+    char *path = source_find(cmd->args[1]);
+    struct stat st;
+    script_t *s = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        if (S_ISREG(st.st_mode)) s = source_lookup(path, fd, &st);
+        else errno = EISDIR;
+    }
+    if (!s) fprintf(stderr, "%s: %s: %s\n", cmd->args[0], cmd->args[1], strerror(errno));
+    if (fd >= 0) close(fd);
+    free(path);
+    if (!s) return 1;
+    
+    source_depth++;
+    int status = script_run(s);
+    source_depth--;
+    script_put(s);
+    return status;
+}
+
+/* cmd NULL: no command word (redirections only, or a subshell) */
+static int is_builtin(const char *cmd) {
+    if (!cmd) return 0;
+    return strcmp(cmd, "cd") == 0 ||
+           strcmp(cmd, "exit") == 0 ||
+           strcmp(cmd, "export") == 0 ||
+           strcmp(cmd, "fg") == 0 ||
+           strcmp(cmd, "bg") == 0 ||
+           strcmp(cmd, "jobs") == 0 ||
+           strcmp(cmd, "wait") == 0 ||
+           strcmp(cmd, "hash") == 0 ||
+           strcmp(cmd, "set") == 0 ||
+           strcmp(cmd, "echo") == 0 ||
+           strcmp(cmd, "printf") == 0 ||
+           strcmp(cmd, "true") == 0 ||
+           strcmp(cmd, "false") == 0 ||
+           strcmp(cmd, ":") == 0 ||
+           strcmp(cmd, "test") == 0 ||
+           strcmp(cmd, "[") == 0 ||
+           strcmp(cmd, "cat") == 0 ||
+           strcmp(cmd, "read") == 0 ||
+           strcmp(cmd, "parallel") == 0 ||
+           strcmp(cmd, "source") == 0 ||
+           strcmp(cmd, ".") == 0;
+}
+
+static int run_builtin(command_t *cmd) {
+    if (strcmp(cmd->args[0], "cd") == 0) return builtin_cd(cmd);
+    if (strcmp(cmd->args[0], "exit") == 0) return builtin_exit(cmd);
+    if (strcmp(cmd->args[0], "export") == 0) return builtin_export(cmd);
+    if (strcmp(cmd->args[0], "fg") == 0) return builtin_fg(cmd);
+    if (strcmp(cmd->args[0], "bg") == 0) return builtin_bg(cmd);
+    if (strcmp(cmd->args[0], "jobs") == 0) return builtin_jobs(cmd);
+    if (strcmp(cmd->args[0], "wait") == 0) return builtin_wait(cmd);
+    if (strcmp(cmd->args[0], "hash") == 0) return builtin_hash(cmd);
+    if (strcmp(cmd->args[0], "set") == 0) return builtin_set(cmd);
+    if (strcmp(cmd->args[0], "echo") == 0) return builtin_echo(cmd);
+    if (strcmp(cmd->args[0], "printf") == 0) return builtin_printf(cmd);
+    if (strcmp(cmd->args[0], "true") == 0) return builtin_true(cmd);
+    if (strcmp(cmd->args[0], "false") == 0) return builtin_false(cmd);
+    if (strcmp(cmd->args[0], ":") == 0) return builtin_true(cmd);
+    if (strcmp(cmd->args[0], "test") == 0) return builtin_test(cmd);
+    if (strcmp(cmd->args[0], "[") == 0) return builtin_test(cmd);
+    if (strcmp(cmd->args[0], "cat") == 0) return builtin_cat(cmd);
+    if (strcmp(cmd->args[0], "read") == 0) return builtin_read(cmd);
+    if (strcmp(cmd->args[0], "parallel") == 0) return builtin_parallel(cmd);
+    if (strcmp(cmd->args[0], "source") == 0) return builtin_source(cmd);
+    if (strcmp(cmd->args[0], ".") == 0) return builtin_source(cmd);
+    return 1;
+}
+
+/*
+ * REDIRECTION SETUP
+ * 
+ * Called in child after fork, before exec.
+ * Opens files and uses dup2 to redirect FDs.
+ */
+static void setup_redirects(command_t *cmd) {
+    for (int i = 0; i < cmd->nredirects; i++) {
+        int fd = open(cmd->redirects[i].file, cmd->redirects[i].flags,
+                     cmd->redirects[i].mode);
+        if (fd < 0) {
+            perror(cmd->redirects[i].file);
+            exit(1);
+        }
+        
+        if (dup2(fd, cmd->redirects[i].fd) < 0) {
+            perror("dup2");
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Redirections for a builtin run by the shell itself
+ * 
+ * Same open() + dup2() as setup_redirects(), but the shell must get
+ * its own fds back afterwards: each target fd is first parked on a
+ * spare fd (F_DUPFD_CLOEXEC, >= 10) and restored by
+ * builtin_restore(). A target that wasn't open is closed again.
+ * 
+ *   echo hi >log  →  saved = dup(1); fd = open("log"); dup2(fd, 1);
+ *                    writev(1, ...); dup2(saved, 1); close(saved)
+ * 
+ * On error (file can't be opened) the redirections done so far are
+ * rolled back and the builtin isn't run, like the child's exit(1).
+ * 
+ * saved[] has nredirects + 1 slots: the last one keeps stdin_is_input,
+ * which a "<" clears and builtin_restore() puts back as it was (in -c
+ * and script mode it was 0 already, and stays 0).
+ */
+static int builtin_redirect(command_t *cmd, int saved[]) {
+    fflush(stdout);
+    fflush(stderr);
+    saved[cmd->nredirects] = stdin_is_input;
+    for (int i = 0; i < cmd->nredirects; i++) {
+        int target = cmd->redirects[i].fd;
+        int j = 0;
+        while (j < i && cmd->redirects[j].fd != target) j++;
+        /* -2: already parked by an earlier redirection, -1: was closed */
+        saved[i] = j < i ? -2 : fcntl(target, F_DUPFD_CLOEXEC, 10);
+        
+        int fd = open(cmd->redirects[i].file, cmd->redirects[i].flags,
+                      cmd->redirects[i].mode);
+        if (fd < 0) {
+            perror(cmd->redirects[i].file);
+            return i + 1;
+        }
+        if (fd != target) {
+            dup2(fd, target);
+            close(fd);
+        }
+        if (target == STDIN_FILENO) stdin_is_input = 0;
+    }
+    return 0;
+}
+
+/* Undo the first n redirections, last first */
+static void builtin_restore(command_t *cmd, int saved[], int n) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = n - 1; i >= 0; i--) {
+        if (saved[i] == -2) continue;
+        if (saved[i] >= 0) {
+            dup2(saved[i], cmd->redirects[i].fd);
+            close(saved[i]);
+        } else {
+            close(cmd->redirects[i].fd);
+        }
+    }
+    stdin_is_input = saved[cmd->nredirects];
+}
+
+/*
+ * BUILTIN PIPELINE STAGES WITHOUT fork()
+ * 
+ * "jobs | grep foo" used to fork a full copy of the shell just to
+ * print a few lines. A subshell is only needed to throw away side
+ * effects; a builtin that merely reports shell state can run in the
+ * shell itself:
+ * 
+ *   jobs, echo, printf, true, false, :, test, [,
+ *   export (no args), hash (no args), set, set -o, set +o
+ * 
+ * cd, fg, bg, hash -r, set -o NAME, export VAR=x keep the fork():
+ * in a pipeline they must not touch the shell (POSIX: each stage
+ * may run in a subshell, and every shell users know does so).
+ * 
+ * The builtin runs synchronously, with stdout pointed at an
+ * open_memstream() buffer (glibc documents stdout as an assignable
+ * variable). A thread then writes the buffer into the stage's pipe,
+ * because the reader may not exist yet and the output can exceed the
+ * pipe capacity. When the thread closes its end, the reader sees EOF.
+ * 
+ * Foreground pipelines only: a thread dies with the shell, and a
+ * background job must not (mysh -c 'jobs | cmd &' exits at once).
+ * Its builtin stages are forked children, as they always were.
+ * 
+ *   Shell state is only read on the main thread, before the writer
+ *   starts, so nothing races with reap_events().
+ *   The writer blocks SIGPIPE: if the reader is gone, write() returns
+ *   EPIPE instead of killing the shell (SIGPIPE for a write is sent to
+ *   the writing thread, and the default action kills the process).
+ * 
+ * Stdin is never read (no builtin reads input); the shell closes its
+ * copy of the upstream pipe, so the writer to it gets EPIPE, exactly
+ * as when the forked child exited.
+ */
+typedef struct {
+    char *buf;
+    size_t len;
+    int fd;
+} builtin_output_t;
+
+static int builtin_is_pure(command_t *cmd) {
+    const char *name = cmd->args[0];
+    if (cmd->nredirects) return 0;
+    if (strcmp(name, "jobs") == 0 || strcmp(name, "echo") == 0 ||
+        strcmp(name, "printf") == 0 || strcmp(name, "true") == 0 ||
+        strcmp(name, "false") == 0 || strcmp(name, ":") == 0 ||
+        strcmp(name, "test") == 0 || strcmp(name, "[") == 0) {
+        return 1;
+    }
+    if (strcmp(name, "export") == 0 || strcmp(name, "hash") == 0) {
+        return cmd->argc == 1;
+    }
+    if (strcmp(name, "set") == 0) {
+        return cmd->argc == 1 || (cmd->argc == 2 &&
+               (strcmp(cmd->args[1], "-o") == 0 ||
+                strcmp(cmd->args[1], "+o") == 0));
+    }
+    return 0;
+}
+
+/*
+ * Stage threads are joinable and listed here, so that the shell can
+ * wait for them when it exits, instead of cutting a copy short.
+ * 
+ * They normally end with their (foreground) job: EOF upstream, or
+ * EPIPE once the reader is gone. What exit still waits for is a job
+ * sent on with bg. Not a stopped job's: its reader may never drain
+ * the pipe; the kernel hangs up that orphaned group when we're gone.
+ */
+static void stage_threads_join(void) {
+    if (getpid() != stage_threads_pid) return;
+    for (int i = 0; i < nstage_threads; i++) {
+        stage_thread_t *t = &stage_threads[i];
+        if (find_job(t->job_id) == t->job && t->job->state == JOB_STOPPED) {
+            continue;
+        }
+        pthread_join(t->tid, NULL);
+    }
+    nstage_threads = 0;
+}
+
+/* pthread_create() + keep track; the finished ones are joined here */
+static int stage_thread_start(job_t *job, void *(*fn)(void *), void *arg) {
+    static int registered;
+    int n = 0;
+    for (int i = 0; i < nstage_threads; i++) {
+        if (pthread_tryjoin_np(stage_threads[i].tid, NULL) != 0) {
+            stage_threads[n++] = stage_threads[i];
+        }
+    }
+    nstage_threads = n;
+    if (n == stage_threads_cap) {
+        stage_threads_cap = stage_threads_cap ? stage_threads_cap * 2 : 8;
+        stage_threads = realloc(stage_threads,
+                                stage_threads_cap * sizeof(*stage_threads));
+        if (!stage_threads) die("realloc");
+    }
+    
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fn, arg) != 0) return -1;
+    if (!registered++) atexit(stage_threads_join);
+    stage_threads_pid = getpid();
+    stage_threads[nstage_threads++] = (stage_thread_t){ tid, job, job->id };
+    return 0;
+}
+
+static void *builtin_writer(void *arg) {
+    builtin_output_t *out = arg;
+    sigset_t pipe_sig;
+    sigemptyset(&pipe_sig);
+    sigaddset(&pipe_sig, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_sig, NULL);
+    
+    for (size_t off = 0; off < out->len; ) {
+        ssize_t n = write(out->fd, out->buf + off, out->len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    close(out->fd);
+    free(out->buf);
+    free(out);
+    return NULL;
+}
+
+/*
+ * cat as a pipeline stage: a thread doing the whole copy
+ * 
+ *   cat log | grep x      thread: files → pipes[0][1] (splice)
+ *   gen | cat | gzip      thread: pipes[0][0] → pipes[1][1] (splice)
+ * 
+ * Only when the output is a pipe to a later stage: the thread then
+ * always ends, with EOF upstream or EPIPE when the reader exits or
+ * is killed by ^C. A cat writing to the shell's own stdout, or
+ * reading the shell's stdin (the terminal), is a forked child like
+ * any other, so ^C and ^Z reach it. So is one in a background job,
+ * which has to outlive the shell (see stage_thread_start()).
+ */
+typedef struct {
+    char **files;
+    int nfiles;
+    int in;
+    int out;
+} cat_stage_t;
+
+static void *cat_thread(void *arg) {
+    cat_stage_t *c = arg;
+    sigset_t pipe_sig;
+    sigemptyset(&pipe_sig);
+    sigaddset(&pipe_sig, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_sig, NULL);
+    
+    cat_files(c->files, c->nfiles, c->in, c->out);
+    
+    if (c->in >= 0) close(c->in);
+    close(c->out);
+    for (int i = 0; i < c->nfiles; i++) free(c->files[i]);
+    free(c->files);
+    free(c);
+    return NULL;
+}
+
+static int run_cat_stage(pipeline_t *pl, int i, int pipes[][2], job_t *job) {
+    command_t *cmd = &pl->cmds[i];
+    int first = 1;
+    if (first < cmd->argc && strcmp(cmd->args[first], "-u") == 0) first++;
+    int nfiles = cmd->argc - first;
+    
+    if (cmd->nredirects || i == pl->ncmds - 1) return -1;
+    for (int j = first; i == 0 && j <= cmd->argc; j++) {
+        if (j == cmd->argc ? nfiles == 0 : strcmp(cmd->args[j], "-") == 0) {
+            return -1;             /* Would read the shell's stdin */
+        }
+    }
+    
+    cat_stage_t *c = calloc(1, sizeof(*c));
+    c->files = calloc(nfiles + 1, sizeof(char *));
+    c->nfiles = nfiles;
+    for (int j = 0; j < nfiles; j++) c->files[j] = strdup(cmd->args[first + j]);
+    
+    /* Own copies: the shell closes its pipe ends after this stage */
+    c->in = i > 0 ? fcntl(pipes[i-1][0], F_DUPFD_CLOEXEC, 3) : -1;
+    c->out = fcntl(pipes[i][1], F_DUPFD_CLOEXEC, 3);
+    
+    if (c->out < 0 || (i > 0 && c->in < 0) ||
+        stage_thread_start(job, cat_thread, c) < 0) {
+        if (c->in >= 0) close(c->in);
+        if (c->out >= 0) close(c->out);
+        for (int j = 0; j < nfiles; j++) free(c->files[j]);
+        free(c->files);
+        free(c);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run stage i of job in the shell if it is a pure builtin.
+ * Returns its exit status, or -1 if it needs a forked child.
+ */
+static int run_builtin_stage(pipeline_t *pl, int i, int pipes[][2], job_t *job) {
+    command_t *cmd = &pl->cmds[i];
+    if (!cmd->args[0] || pl->background) return -1;
+    if (strcmp(cmd->args[0], "cat") == 0) return run_cat_stage(pl, i, pipes, job);
+    if (!is_builtin(cmd->args[0]) || !builtin_is_pure(cmd)) return -1;
+    
+    /* Last stage: its stdout is the shell's, nothing can block on it */
+    if (i == pl->ncmds - 1) {
+        builtin_in_pipeline = 1;
+        int status = run_builtin(cmd);
+        builtin_in_pipeline = 0;
+        fflush(stdout);
+        return status;
+    }
+    
+    builtin_output_t *out = calloc(1, sizeof(*out));
+    FILE *mem = out ? open_memstream(&out->buf, &out->len) : NULL;
+    if (!mem) {
+        free(out);
+        return -1;
+    }
+    
+    FILE *saved = stdout;
+    stdout = mem;
+    builtin_in_pipeline = 1;
+    int status = run_builtin(cmd);
+    builtin_in_pipeline = 0;
+    stdout = saved;
+    fclose(mem);
+    
+    /* Own copy: the shell closes pipes[i][1] once stage i+1 exists */
+    out->fd = fcntl(pipes[i][1], F_DUPFD_CLOEXEC, 3);
+    if (out->fd < 0 || stage_thread_start(job, builtin_writer, out) < 0) {
+        if (out->fd >= 0) close(out->fd);
+        free(out->buf);
+        free(out);
+        return -1;
+    }
+    return status;
+}
+
+/*
+ * ZYGOTE - PRE-FORKED LAUNCHER (set -o zygote)
+ * 
+ * Idea borrowed from Android: fork a tiny helper early, while the
+ * shell is still small, and let IT produce children for launching.
+ * 
+ * Process layout:
+ * 
+ *   shell ──fork()──► zygote (sleeps in read(), dies with shell)
+ *     │                  │
+ *     │                  └─clone(CLONE_PARENT)──► pool child × ZYGOTE_POOL
+ *     │                                            (blocked in recvmsg())
+ *     └─ parent of every pool child (CLONE_PARENT), so pidfds, waitid(),
+ *        stop/continue reports and job control work exactly as for
+ *        posix_spawn()'d stages.
+ * 
+ * The zygote leads a process group of its own, which idle pool
+ * children share: that group is how the shell finds (and reaps) them
+ * when it stops the zygote, since it never learns their pids.
+ * 
+ * Launch protocol over one SOCK_SEQPACKET socketpair:
+ *   shell → pool:  request (header + path/argv/envp/redirect strings)
+ *                  + SCM_RIGHTS [stdin, stdout, stderr, cwd, (binary)]
+ *   pool child:    tells zygote to fork a replacement
+ *   pool → shell:  its pid (no reply sent: _exit(), never exec)
+ *   pool child:    joins the process group, takes the terminal if
+ *                  foreground (as the shell does too, for the race),
+ *                  dup2()s the fds, fchdir(cwd), execveat() of the
+ *                  cached binary fd if one was sent, else execve()
+ * 
+ * SEQPACKET keeps message boundaries, and the kernel hands each
+ * request to exactly one of the pool children blocked in recvmsg().
+ * 
+ * SCM_RIGHTS - passing FDs between processes
+ * --------------------------------------------
+ *   sendmsg() with cmsg_type SCM_RIGHTS installs duplicates of the
+ *   sender's FDs in the receiver's FD table (same struct file, like
+ *   dup()). This is how the pool child gets pipe ends that didn't
+ *   exist when it was forked.
+ * 
+ * Critical path per stage: sendmsg() + recv() in the shell; no fork,
+ * no page-table copy, no signal reset in the shell's address space.
+ * Any failure (message too large, zygote gone) falls back to
+ * posix_spawn().
+ */
+#define ZYGOTE_POOL 4
+#define ZYGOTE_MSG_MAX 65536
+#define ZYGOTE_REDIRECTS 16       /* More: posix_spawn() */
+
+typedef struct {
+    int argc;
+    int envc;
+    int nredirects;
+    pid_t pgid;               /* 0: become group leader */
+    int foreground;           /* Take the terminal */
+    mode_t umask;
+    struct {
+        int fd;
+        int flags;
+        mode_t mode;
+    } redirects[ZYGOTE_REDIRECTS];
+    /* Followed by NUL-terminated strings:
+     * path, argv[argc], envp[envc], redirect files[nredirects] */
+} zygote_req_t;
+
+
+static void zygote_child(int sock, int refill) {
+    static char buf[ZYGOTE_MSG_MAX];
+    union {
+        struct cmsghdr h;
+        char b[CMSG_SPACE(5 * sizeof(int))];
+    } cm;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cm.b;
+    msg.msg_controllen = sizeof(cm.b);
+    
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < (ssize_t)sizeof(zygote_req_t)) _exit(0);  /* Shell closed */
+    
+    /* Taken: zygote forks a replacement, we stop dying with the shell */
+    char c = 1;
+    if (write(refill, &c, 1) < 0) { /* Zygote gone: no refill */ }
+    close(refill);
+    prctl(PR_SET_PDEATHSIG, 0);
+    signal(SIGPIPE, SIG_DFL);
+    
+    struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+    if (!h || h->cmsg_type != SCM_RIGHTS ||
+        (h->cmsg_len != CMSG_LEN(4 * sizeof(int)) &&
+         h->cmsg_len != CMSG_LEN(5 * sizeof(int)))) _exit(126);
+    int fds[5] = { -1, -1, -1, -1, -1 };
+    memcpy(fds, CMSG_DATA(h), h->cmsg_len - CMSG_LEN(0));
+    
+    zygote_req_t *req = (zygote_req_t *)buf;
+    char **strs = malloc((2 + req->argc + req->envc + req->nredirects) *
+                         sizeof(char *));
+    char *p = buf + sizeof(*req);
+    char *path = p;
+    p += strlen(p) + 1;
+    char **argv = strs;
+    for (int i = 0; i < req->argc; i++, p += strlen(p) + 1) argv[i] = p;
+    argv[req->argc] = NULL;
+    char **envp = argv + req->argc + 1;
+    for (int i = 0; i < req->envc; i++, p += strlen(p) + 1) envp[i] = p;
+    envp[req->envc] = NULL;
+    
+    /* A failed reply means the shell gave up waiting and launched the
+     * command itself: running it here too would run it twice */
+    pid_t pid = getpid();
+    if (send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid)) _exit(126);
+    close(sock);
+    
+    /* Process group + terminal: the shell sets both as well once it
+     * has our pid, whichever of us gets there first */
+    setpgid(0, req->pgid);
+    if (req->foreground) {
+        sigset_t ttou, old;
+        sigemptyset(&ttou);
+        sigaddset(&ttou, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &ttou, &old);
+        tcsetpgrp(shell_terminal, getpgrp());
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+
+    dup2(fds[0], 0);
+    dup2(fds[1], 1);
+    dup2(fds[2], 2);
+    if (fchdir(fds[3]) < 0) _exit(126);
+    umask(req->umask);
+    
+    for (int i = 0; i < req->nredirects; i++, p += strlen(p) + 1) {
+        int fd = open(p, req->redirects[i].flags, req->redirects[i].mode);
+        if (fd < 0) {
+            perror(p);
+            _exit(1);
+        }
+        dup2(fd, req->redirects[i].fd);
+        close(fd);
+        if (req->redirects[i].fd == fds[4]) fds[4] = -1;  /* Clobbered */
+    }
+    
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    
+    if (fds[4] >= 0) {
+        syscall(SYS_execveat, fds[4], "", argv, envp, AT_EMPTY_PATH);
+    }
+    execve(path, argv, envp);
+    perror(path);
+    _exit(errno == ENOENT ? 127 : 126);
+}
+
+static void zygote_fork_child(int sock, int refill) {
+    /* Raw clone(): glibc's fork() has no CLONE_PARENT */
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != zygote_shell_pid) _exit(0);
+        signal(SIGPIPE, SIG_IGN);  /* Refill write if zygote died */
+        zygote_child(sock, refill);
+    }
+}
+
+static void zygote_main(int sock) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != zygote_shell_pid) _exit(0);
+    setpgid(0, 0);                /* Pool children inherit it */
+
+    /* Drop the shell's epoll/signalfd/pidfds; keep only the socket */
+    close_range(3, sock - 1, 0);
+    close_range(sock + 1, ~0U, 0);
+    
+    int refill[2];
+    if (pipe2(refill, O_CLOEXEC) < 0) _exit(1);
+    
+    for (int i = 0; i < ZYGOTE_POOL; i++) {
+        zygote_fork_child(sock, refill[1]);
+    }
+    
+    /* One byte per consumed pool child → fork its replacement */
+    char c;
+    while (read(refill[0], &c, 1) == 1) {
+        zygote_fork_child(sock, refill[1]);
+    }
+    _exit(0);
+}
+
+static int zygote_start(void) {
+    if (zygote_pid > 0) return 0;
+    
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        return -1;
+    }
+    
+    zygote_shell_pid = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    
+    close(sv[1]);
+    setpgid(pid, pid);            /* Both sides: zygote_stop() relies on it */
+    zygote_sock = sv[0];
+    zygote_pid = pid;
+
+    /* A pool child dying between recvmsg() and its reply must not hang
+     * the shell: give up after a second and fall back */
+    struct timeval tv = { 1, 0 };
+    setsockopt(zygote_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return 0;
+}
+
+static void zygote_stop(void) {
+    if (zygote_pid <= 0) return;
+    
+    /* A pool child that replies from now on gets EPIPE and exits; one
+     * that replied after zygote_spawn() stopped waiting is queued here
+     * and about to exec a command already launched elsewhere */
+    shutdown(zygote_sock, SHUT_RD);
+    pid_t late;
+    while (recv(zygote_sock, &late, sizeof(late), MSG_DONTWAIT) == sizeof(late)) {
+        kill(late, SIGKILL);
+        waitpid(late, NULL, 0);
+    }
+    close(zygote_sock);
+    zygote_sock = -1;
+    
+    /* Idle pool children are the shell's (CLONE_PARENT) but in no job:
+     * nothing else would reap them. Zygote and pool are one group */
+    kill(-zygote_pid, SIGKILL);
+    while (waitpid(-zygote_pid, NULL, 0) > 0) {}
+    zygote_pid = 0;
+}
+
+/* Append a string to the request; NULL if it doesn't fit */
+static char *zygote_put(char *out, const char *end, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (!out || out + len > end) return NULL;
+    memcpy(out, s, len);
+    return out + len;
+}
+
+/*
+ * Launch one stage through a pool child.
+ * Returns its pid, or -1 to fall back to posix_spawn().
+ */
+static pid_t zygote_spawn(pipeline_t *pl, int i, pid_t pgid, int pipes[][2],
+                          const char *path, int binfd) {
+    static char buf[ZYGOTE_MSG_MAX];
+    command_t *cmd = &pl->cmds[i];
+    zygote_req_t *req = (zygote_req_t *)buf;
+    char *out = buf + sizeof(*req);
+    const char *end = buf + sizeof(buf);
+    
+    if (cmd->nredirects > ZYGOTE_REDIRECTS) return -1;
+    memset(req, 0, sizeof(*req));
+    req->argc = cmd->argc;
+    req->pgid = pgid;
+    req->foreground = pgid == 0 && interactive && !pl->background;
+    req->umask = umask(0);
+    umask(req->umask);
+    
+    out = zygote_put(out, end, path);
+    for (int j = 0; j < cmd->argc; j++) {
+        out = zygote_put(out, end, cmd->args[j]);
+    }
+    for (char **e = environ; *e; e++) {
+        out = zygote_put(out, end, *e);
+        req->envc++;
+    }
+    for (int j = 0; j < cmd->nredirects; j++) {
+        req->redirects[j].fd = cmd->redirects[j].fd;
+        req->redirects[j].flags = cmd->redirects[j].flags;
+        req->redirects[j].mode = cmd->redirects[j].mode;
+        out = zygote_put(out, end, cmd->redirects[j].file);
+    }
+    req->nredirects = cmd->nredirects;
+    if (!out) return -1;  /* Huge environment: use posix_spawn() */
+    
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) return -1;
+    
+    int fds[5] = {
+        i > 0 ? pipes[i-1][0] : STDIN_FILENO,
+        i < pl->ncmds - 1 ? pipes[i][1] : STDOUT_FILENO,
+        STDERR_FILENO,
+        cwd,
+        binfd
+    };
+    size_t nfds = binfd >= 0 ? 5 : 4;
+    union {
+        struct cmsghdr h;
+        char b[CMSG_SPACE(sizeof(fds))];
+    } cm;
+    struct iovec iov = { buf, out - buf };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    memset(&cm, 0, sizeof(cm));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cm.b;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(h), fds, nfds * sizeof(int));
+    
+    ssize_t sent = sendmsg(zygote_sock, &msg, MSG_NOSIGNAL);
+    close(cwd);
+    
+    pid_t pid;
+    if (sent < 0 || recv(zygote_sock, &pid, sizeof(pid), 0) != sizeof(pid)) {
+        /* Zygote gone: turn the option off, launch directly */
+        fprintf(stderr, "zygote: launcher unavailable, disabling\n");
+        zygote_stop();
+        opt_zygote = 0;
+        return -1;
+    }
+    return pid;
+}
+
+/* Job table label: "cmd args | cmd args"; a subshell as typed */
+static char *pipeline_text(pipeline_t *pl) {
+    size_t len = 1;
+    for (int i = 0; i < pl->ncmds; i++) {
+        for (int j = 0; j < pl->cmds[i].argc; j++) {
+            len += strlen(pl->cmds[i].args[j]) + 1;
+        }
+        if (pl->cmds[i].subshell) len += pl->cmds[i].subshell->len + 1;
+        len += 2;
+    }
+    
+    char *text = malloc(len);
+    char *out = text;
+    for (int i = 0; i < pl->ncmds; i++) {
+        if (i > 0) out = stpcpy(out, "| ");
+        if (pl->cmds[i].subshell) {
+            out = mempcpy(out, pl->cmds[i].subshell->word, pl->cmds[i].subshell->len);
+            *out++ = ' ';
+        }
+        for (int j = 0; j < pl->cmds[i].argc; j++) {
+            out = stpcpy(out, pl->cmds[i].args[j]);
+            *out++ = ' ';
+        }
+    }
+    if (out > text) out--;  /* Trailing space */
+    *out = '\0';
+    return text;
+}
+
+/*
+ * STAGE LAUNCHING - posix_spawn() INSTEAD OF fork()
+ * 
+ * Cost of fork() grows with the shell's RSS:
+ *   fork() → copy_mm() → duplicates every VMA and page table entry
+ *   Long-lived shell (history, variables, caches) → bigger page tables
+ *   Child immediately calls execve() and throws the copy away!
+ * 
+ * posix_spawn() - glibc: clone(CLONE_VM | CLONE_VFORK)
+ * --------------
+ * Kernel operation:
+ *   - Child SHARES parent's address space (no page table copy)
+ *   - Parent is suspended until child calls execve() or _exit()
+ *   - Child runs on a separate small stack allocated by glibc
+ *   Cost: constant, independent of shell RSS
+ * 
+ * Everything the fork() child did by hand is described declaratively:
+ *   Attributes (applied first, with all signals blocked):
+ *     POSIX_SPAWN_SETSIGDEF:  SIGINT/SIGQUIT/... back to SIG_DFL
+ *     POSIX_SPAWN_SETSIGMASK: Child starts with empty signal mask
+ *     POSIX_SPAWN_SETPGROUP:  setpgid(0, pgid) (0 = new group leader)
+ *   File actions (applied in order):
+ *     tcsetpgrp(tty, getpgrp()) for a foreground group leader
+ *     dup2(pipe_read, 0), dup2(pipe_write, 1)
+ *     open() + dup2() for each redirection
+ * 
+ * Pipe FDs are created with O_CLOEXEC, so the exec closes every pipe
+ * end the stage did not dup2() onto 0/1 (dup2 clears FD_CLOEXEC).
+ * The fork() path drops them with a single close_range().
+ * 
+ * close_range(first, last, flags) - syscall (Linux 5.9)
+ * ---------------------------------
+ *   Closes every open FD in [first, last]. The kernel walks the FD
+ *   bitmap, so cost follows open FDs, not the range: one syscall
+ *   instead of one close() per pipe end (O(n) per child, O(n^2) per
+ *   pipeline).
+ * 
+ * When fork() is still required (a full copy of the shell):
+ *   - Builtin inside a pipeline: runs shell code, not execve()
+ *   - Command not found with redirections: child opens the files
+ *     first, then prints diagnostic and exits 127
+ *   - posix_spawn() failed (bad redirect, exec error): re-run the
+ *     stage with fork() so the error is reported exactly as before
+ */
+static void exec_stage(pipeline_t *pl, int i, pid_t pgid, int pipes[][2],
+                       const char *path) {
+    /* Shell keeps SIGCHLD blocked (signalfd); children must not */
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    
+    /* Reset signal handlers to default */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    
+    /* Set process group (first launched stage becomes leader) */
+    if (pgid == 0) {
+        pgid = getpid();
+        setpgid(0, pgid);
+        if (interactive && !pl->background) {
+            tcsetpgrp(shell_terminal, pgid);
+        }
+    } else {
+        setpgid(0, pgid);
+    }
+    
+    /* Setup pipes */
+    if (i > 0) {
+        dup2(pipes[i-1][0], 0);
+    }
+    if (i < pl->ncmds - 1) {
+        dup2(pipes[i][1], 1);
+    }
+    
+    /* Join the job's cgroup leaf (set -o cgroups) while the fd is open */
+    if (spawn_cgroup >= 0 && write(spawn_cgroup, "0", 1) < 0) {
+        /* Refused: run uncontained */
+    }
+    
+    /* Drop every other FD: pipe ends, epoll/signalfd/pidfds, binary
+     * cache. An exec would close them anyway (all O_CLOEXEC), but a
+     * builtin runs here and must not hold a pipe open. One syscall,
+     * however long the pipeline. */
+    close_range(3, ~0U, 0);
+    
+    /* The shell's read-ahead (read_line()) stays with the shell, and
+     * the zygote socket and binary cache fds were just closed: a
+     * builtin launching commands from here (parallel) must not use
+     * them */
+    stdin_is_input = 0;
+    opt_zygote = 0;
+    zygote_pid = 0;
+    bin_cache_abandon();
+    spawn_cgroup = cg_root = -1;
+    
+    /* Not this process's children: `wait` here has nothing to join */
+    njobs = 0;
+    nrunning_jobs = 0;
+    changed_head = changed_tail = NULL;
+    
+    /* Setup redirections */
+    setup_redirects(&pl->cmds[i]);
+    
+    /* ( list ): this copy of the shell runs it and is done */
+    if (pl->cmds[i].subshell) {
+        subshell_enter();
+        exit(run_list(pl->cmds[i].subshell->body));
+    }
+    
+    /* Redirections alone (> file): opening them was the command */
+    if (!pl->cmds[i].args[0]) exit(0);
+    
+    /* Execute builtin or external command */
+    if (is_builtin(pl->cmds[i].args[0])) {
+        exit(run_builtin(&pl->cmds[i]));
+    }
+    
+    char **args = pl->cmds[i].args;
+    if (path) {
+        execv(path, args);
+        
+        /* Cached location went away: walk PATH again */
+        if (errno == ENOENT && !strchr(args[0], '/')) {
+            path_cache_forget(args[0]);
+            path = find_in_path(args[0]);
+            if (path) execv(path, args);
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "%s: command not found\n", args[0]);
+        exit(127);
+    }
+    
+    perror("execv");
+    exit(1);
+}
+
+/*
+ * vfork() + execveat() - launch from a cached binary fd
+ * 
+ * vfork() - syscall: clone(CLONE_VM | CLONE_VFORK)
+ * -------------------------------------------------
+ *   Child borrows the parent's memory (no page-table copy, like
+ *   posix_spawn()); parent is suspended until the child execs or
+ *   exits. The child may only make syscalls: any write to memory is
+ *   a write to the shell's memory.
+ * 
+ * Safe here because the shell has no signal handlers (everything is
+ * SIG_IGN or read through signalfd), so nothing can run shell code on
+ * the child's borrowed stack. Errors travel back the way glibc's
+ * posix_spawn() does it: the child stores errno in parent memory.
+ */
+static volatile int vfork_errno;
+
+static pid_t vfork_stage(pipeline_t *pl, int i, pid_t pgid, int pipes[][2],
+                         const char *path, int binfd) {
+    command_t *cmd = &pl->cmds[i];
+    char **args = cmd->args;
+    int foreground = pgid == 0 && interactive && !pl->background;
+    
+    vfork_errno = 0;
+    pid_t pid = vfork();
+    if (pid == 0) {
+        if (spawn_cgroup >= 0 && write(spawn_cgroup, "0", 1) < 0) {
+            /* Job's cgroup leaf refused us: run uncontained */
+        }
+    
+        /* SIGTTOU still ignored here, so tcsetpgrp() can't stop us */
+        setpgid(0, pgid);
+        if (foreground) tcsetpgrp(shell_terminal, getpgrp());
+    
+        if (i > 0 && dup2(pipes[i-1][0], 0) < 0) goto fail;
+        if (i < pl->ncmds - 1 && dup2(pipes[i][1], 1) < 0) goto fail;
+        for (int j = 0; j < cmd->nredirects; j++) {
+            int fd = open(cmd->redirects[j].file, cmd->redirects[j].flags,
+                          cmd->redirects[j].mode);
+            if (fd < 0) goto fail;
+            if (fd != cmd->redirects[j].fd) {
+                if (dup2(fd, cmd->redirects[j].fd) < 0) goto fail;
+                close(fd);
+            }
+        }
+    
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+    
+        if (binfd >= 0) syscall(SYS_execveat, binfd, "", args, environ, AT_EMPTY_PATH);
+        /* No cached fd, or raced with a rewrite into a script: by path */
+        execv(path, args);
+fail:
+        vfork_errno = errno ? errno : EINVAL;
+        _exit(127);
+    }
+    if (pid < 0) return -1;
+    
+    if (vfork_errno) {
+        /* Child is already dead; reap it here, the job never saw it */
+        waitpid(pid, NULL, 0);
+        errno = vfork_errno;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * Returns child PID, or -1 (errno set) if this stage must go through fork().
+ */
+static pid_t spawn_stage(pipeline_t *pl, int i, pid_t pgid, int pipes[][2],
+                         const char *path) {
+    command_t *cmd = &pl->cmds[i];
+    
+    if (!path || is_builtin(cmd->args[0])) {
+        errno = 0;
+        return -1;
+    }
+    
+    /* Cached binary fd, unless a redirection would land on it */
+    int binfd = bin_cache_fd(path);
+    for (int j = 0; j < cmd->nredirects; j++) {
+        if (cmd->redirects[j].fd == binfd) binfd = -1;
+    }
+    
+    /* A cgroup leaf to join takes a child that runs our code first */
+    if (opt_zygote && zygote_pid > 0 && spawn_cgroup < 0) {
+        pid_t pid = zygote_spawn(pl, i, pgid, pipes, path, binfd);
+        if (pid > 0) return pid;
+    }
+    
+    if (binfd >= 0 || spawn_cgroup >= 0) {
+        return vfork_stage(pl, i, pgid, pipes, path, binfd);
+    }
+    
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t fa;
+    sigset_t sigdef, sigmask;
+    
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&fa);
+    
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGINT);
+    sigaddset(&sigdef, SIGQUIT);
+    sigaddset(&sigdef, SIGTSTP);
+    sigaddset(&sigdef, SIGTTIN);
+    sigaddset(&sigdef, SIGTTOU);
+    sigaddset(&sigdef, SIGCHLD);
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    
+    /* Terminal handoff inside the child, same as the fork() path.
+     * Runs while glibc keeps all signals blocked, so no SIGTTOU. */
+    if (pgid == 0 && interactive && !pl->background) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&fa, shell_terminal);
+    }
+    
+    if (i > 0) {
+        posix_spawn_file_actions_adddup2(&fa, pipes[i-1][0], 0);
+    }
+    if (i < pl->ncmds - 1) {
+        posix_spawn_file_actions_adddup2(&fa, pipes[i][1], 1);
+    }
+    
+    for (int j = 0; j < cmd->nredirects; j++) {
+        posix_spawn_file_actions_addopen(&fa, cmd->redirects[j].fd,
+                                         cmd->redirects[j].file,
+                                         cmd->redirects[j].flags,
+                                         cmd->redirects[j].mode);
+    }
+    
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &fa, &attr, cmd->args, environ);
+    
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * PIPE CAPACITY - $PIPESIZE
+ * 
+ * A pipe is a ring of pages (struct pipe_inode_info, 16 × 4 KiB =
+ * 64 KiB by default). A writer that fills it sleeps until the reader
+ * drains some; a reader that empties it sleeps until the writer
+ * refills. With "producer | filter | gzip" moving gigabytes, 64 KiB
+ * means a context switch every few hundred microseconds per stage.
+ * 
+ * fcntl(fd, F_SETPIPE_SZ, bytes) - resize the ring
+ * -------------------------------------------------
+ *   Rounded up to a power-of-two number of pages. Unprivileged
+ *   callers are capped at /proc/sys/fs/pipe-max-size (1 MiB default,
+ *   EPERM above it) and by the per-user page budget
+ *   (pipe-user-pages-soft, EPERM/ENOMEM when exhausted).
+ * 
+ * PIPESIZE=1M applies to every inter-stage pipe of later pipelines
+ * (plain bytes or a K/M suffix). Values above pipe-max-size are
+ * clamped to it; if the kernel still refuses, the pipe keeps its
+ * default size. Unset or empty: no fcntl() at all.
+ */
+static long pipe_size(void) {
+    static long pipe_max;
+    const char *v = get_var("PIPESIZE");
+    if (!v || !*v) return 0;
+    
+    char *end;
+    long size = strtol(v, &end, 10);
+    if (*end == 'k' || *end == 'K') size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M') size <<= 20, end++;
+    if (*end || size <= 0) return 0;
+    
+    if (pipe_max == 0) {
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (!f || fscanf(f, "%ld", &pipe_max) != 1) pipe_max = 1 << 20;
+        if (f) fclose(f);
+    }
+    return size < pipe_max ? size : pipe_max;
+}
+
+/*
+ * PIPELINE EXECUTION
+ * 
+ * Core algorithm:
+ * 1. Create all pipes upfront
+ * 2. Spawn each command, setting up pipe FDs (fork() only as fallback)
+ * 3. First child creates new PGRP, others join it
+ * 4. Give terminal to PGRP if foreground
+ * 5. Close all pipe FDs in parent
+ * 6. Wait for completion (foreground) or return (background)
+ * 
+ * Race condition handling: Both parent and child call setpgid() to
+ * avoid race where parent tries to tcsetpgrp() before child setpgid().
+ */
+static int execute_pipeline(pipeline_t *pl) {
+    if (pl->ncmds == 0) return 0;
+    
+    struct timespec start;
+    struct rusage shell_ru;
+    if (pl->timed) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &shell_ru);
+    }
+    
+    /* Single builtin without pipes */
+    if (pl->ncmds == 1 && is_builtin(pl->cmds[0].args[0]) && !pl->background &&
+        builtin_in_shell_ok(&pl->cmds[0])) {
+        command_t *cmd = &pl->cmds[0];
+        int *saved = arena_alloc(&run_arena, (cmd->nredirects + 1) * sizeof(*saved));
+        int failed = builtin_redirect(cmd, saved);
+        int status = failed ? 1 : run_builtin(cmd);
+        builtin_restore(cmd, saved, failed ? failed : cmd->nredirects);
+        if (pl->timed) time_report(NULL, &start, &shell_ru);
+        return pl->negate ? !status : status;
+    }
+    
+    /* Resolve every stage BEFORE creating any pipe or process
+     * 
+     * Command not found is known in the parent (negative results are
+     * cached too), so "typo" or "nonexistent-command || fallback"
+     * costs a hash lookup instead of pipe() + fork() + exit(127).
+     * 
+     * Exception: a missing command with redirections still goes
+     * through a child, which opens/truncates the files first (POSIX
+     * performs redirections before the command search fails).
+     */
+    int n = pl->ncmds;            /* Per-stage arrays: gone with the run */
+    const char **paths = arena_alloc(&run_arena, n * sizeof(*paths));
+    int *missing = arena_alloc(&run_arena, n * sizeof(*missing));
+    int *stale = arena_alloc(&run_arena, n * sizeof(*stale));
+    int *in_shell = arena_alloc(&run_arena, n * sizeof(*in_shell));
+    int nmissing = 0;             /* in_shell: builtin run without fork */
+    for (int i = 0; i < pl->ncmds; i++) {
+        command_t *cmd = &pl->cmds[i];
+        paths[i] = !cmd->args[0] || is_builtin(cmd->args[0]) ? NULL :
+                   find_in_path(cmd->args[0]);
+        missing[i] = cmd->nredirects == 0 && cmd->args[0] &&
+                     !is_builtin(cmd->args[0]) && !paths[i];
+        stale[i] = 0;
+        in_shell[i] = -1;
+        if (missing[i]) {
+            fprintf(stderr, "%s: command not found\n", cmd->args[0]);
+            nmissing++;
+        }
+    }
+    
+    if (nmissing == pl->ncmds) {
+        int status = missing[pl->ncmds - 1] ? 127 : 0;
+        return pl->negate ? !status : status;
+    }
+    
+    int (*pipes)[2] = arena_alloc(&run_arena, n * sizeof(*pipes));
+    pid_t pgid = in_subshell ? getpgrp() : 0;  /* 0: first stage leads */
+    pid_t last_pid = 0;
+    
+    char *text = pipeline_text(pl);
+    job_t *job = add_job(text, pl->ncmds, pl->background);
+    free(text);
+    if (pl->timed) {
+        job->timed = 1;
+        job->start = start;
+        job->shell_ru = shell_ru;
+    }
+    
+    long pipesz = pl->ncmds > 1 ? pipe_size() : 0;
+    
+    /* set -o cgroups: each child joins the job's leaf itself */
+    if (job->cgfd >= 0) {
+        spawn_cgroup = openat(job->cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    }
+    
+    /* Spawn (or fork) and execute commands
+     * 
+     * Pipes are created one stage ahead and closed as soon as both of
+     * their stages exist, so the shell holds at most two pipes (four
+     * fds) at any time, whatever the pipeline length:
+     * 
+     *   stage i:  pipe2(pipes[i])  spawn  close(pipes[i-1][0])
+     *                                     close(pipes[i][1])
+     * 
+     * O_CLOEXEC: a spawned stage keeps only the ends it dup2'd onto
+     * 0/1; the other end of its own pipes and pipes[i+1] never survive
+     * the exec. 2 syscalls per pipe in the parent, 0-2 dup2() per child.
+     */
+    for (int i = 0; i < pl->ncmds; i++) {
+        if (i < pl->ncmds - 1) {
+            if (pipe2(pipes[i], O_CLOEXEC) < 0) die("pipe");
+            if (pipesz) fcntl(pipes[i][1], F_SETPIPE_SZ, (int)pipesz);
+        }
+        
+        /* Missing stage: neighbours just see EOF / SIGPIPE */
+        pid_t pid = 0;
+        if (!missing[i]) {
+            if (pl->ncmds > 1) in_shell[i] = run_builtin_stage(pl, i, pipes, job);
+            if (in_shell[i] < 0) pid = spawn_stage(pl, i, pgid, pipes, paths[i]);
+        }
+        
+        if (pid < 0) {
+            /* ENOENT may be a redirection target ("wc < typo"): only
+             * the binary itself being gone makes the entry stale */
+            stale[i] = errno == ENOENT && paths[i] && access(paths[i], X_OK) < 0;
+            fflush(stdout);  /* Or the child's exit() writes it again */
+            pid = fork();
+            if (pid < 0) die("fork");
+            if (pid == 0) {  /* Child */
+                exec_stage(pl, i, pgid, pipes, paths[i]);
+            }
+        }
+        
+        /* Both stages of pipes[i-1] exist now; pipes[i] waits for i+1 */
+        if (i > 0) close(pipes[i-1][0]);
+        if (i < pl->ncmds - 1) close(pipes[i][1]);
+        if (pid == 0) continue;
+        
+        /* Parent */
+        job_add_proc(job, pid);
+        if (job->timed) {
+            job->procs[job->nprocs - 1].name =
+                strdup(pl->cmds[i].args[0] ? pl->cmds[i].args[0] : "(subshell)");
+        }
+        last_pid = pid;
+        if (pgid == 0) {
+            pgid = pid;
+            setpgid(pid, pgid);
+            if (interactive && !pl->background) {
+                tcsetpgrp(shell_terminal, pgid);
+            }
+        } else {
+            setpgid(pid, pgid);
+        }
+    }
+    
+    if (spawn_cgroup >= 0) close(spawn_cgroup);
+    spawn_cgroup = -1;
+    
+    /* Cached path vanished (ENOENT, and access() agrees): re-walk PATH
+     * next time. Deferred until here because paths[] point into the cache. */
+    for (int i = 0; i < pl->ncmds; i++) {
+        if (stale[i]) path_cache_forget(pl->cmds[i].args[0]);
+    }
+    
+    job->pgid = pgid;
+    
+    /* Only builtins, all run in the shell: nothing to wait for */
+    if (job->nprocs == 0) {
+        remove_job(job);
+        int status = pl->background ? 0 : in_shell[pl->ncmds - 1];
+        if (status < 0) status = missing[pl->ncmds - 1] ? 127 : 0;
+        return pl->negate ? !status : status;
+    }
+    
+    if (pl->background) {
+        last_bg_pid = last_pid;
+        printf("[%d] %d\n", job->id, pgid);
+        return 0;
+    }
+    
+    /* Wait for foreground job (all members, via the reaping engine) */
+    int status = wait_foreground(job);
+    if (missing[pl->ncmds - 1]) status = 127;
+    if (in_shell[pl->ncmds - 1] >= 0) status = in_shell[pl->ncmds - 1];
+    
+    return pl->negate ? !status : status;
+}
+
+/*
+ * EXPANSION
+ * 
+ * Handles: $VAR, ${VAR}, ~, ~user, and quote removal:
+ * 
+ *   '...'   literal, nothing expanded
+ *   "..."   $ expanded; \ escapes only $ ` " \
+ *   \c      c literal
+ *   \⏎      removed, in "..." too: the word goes on (scripts' lines)
+ * 
+ * word/len/quote are a lexer span (quote == 0: no quoting in it, the
+ * common case, no quote state kept). Returns a string in run_arena,
+ * gone when the pipeline's run releases it.
+ * 
+ * pattern (may be NULL): set when the word has a * or ? that wasn't
+ * quoted (one from an unquoted $VAR counts) - a glob() pattern in
+ * which the quoted metacharacters are backslash-escaped, or the
+ * returned string itself when nothing was quoted. NULL otherwise.
+ * Good until the next expand_word(): never freed.
+ * 
+ * The word is built in buffers kept from call to call, so after the
+ * first few words expanding allocates nothing but its arena copy.
+ */
+typedef struct {
+    outbuf_t out;          /* The word */
+    outbuf_t pat;          /* Glob pattern; quoted words only */
+    int quoted_word;
+    int globs;             /* Unquoted * or ? seen */
+} expansion_t;
+
+static void exp_add(expansion_t *e, const char *s, size_t n, int quoted) {
+    out_add(&e->out, s, n);
+    if (!quoted && !e->globs && (memchr(s, '*', n) || memchr(s, '?', n))) {
+        e->globs = 1;
+    }
+    if (!e->quoted_word) return;
+    for (size_t i = 0; i < n; i++) {
+        if (quoted && strchr("*?[\\", s[i])) out_add(&e->pat, "\\", 1);
+        out_add(&e->pat, &s[i], 1);
+    }
+}
+
+static char *expand_word(const char *word, size_t len, int quote, char **pattern) {
+    /* Any length: a word from an unbounded input line may be, too */
+    static expansion_t e;
+    e.out.len = e.pat.len = 0;
+    e.quoted_word = quote != 0;
+    e.globs = 0;
+    const char *p = word;
+    const char *end = word + len;
+    int dq = 0;            /* Inside "..." */
+    
+    while (p < end) {
+        if (*p == '\'' && !dq) {
+            /* The lexer guarantees the closing quote */
+            const char *q = memchr(p + 1, '\'', end - p - 1);
+            exp_add(&e, p + 1, q - p - 1, 1);
+            p = q + 1;
+        } else if (*p == '"') {
+            dq = !dq;
+            p++;
+        } else if (*p == '\\' && quote) {
+            if (p + 1 < end && p[1] == '\n') {
+                p += 2;
+            } else if (p + 1 < end && (!dq || strchr("$`\"\\", p[1]))) {
+                exp_add(&e, p + 1, 1, 1);
+                p += 2;
+            } else {
+                exp_add(&e, p++, 1, 1);
+            }
+        } else if (*p == '$') {
+            p++;
+            char varname[256];
+            int i = 0;
+            
+            if (p < end && *p == '{') {
+                p++;
+                while (p < end && *p != '}' && i < 255) {
+                    varname[i++] = *p++;
+                }
+                if (p < end && *p == '}') p++;
+            } else if (p < end && (isdigit((unsigned char)*p) || strchr("?$!#@*", *p))) {
+                /* Special and positional names are one character:
+                 * $10 is ${1}0, $$x is ${$}x */
+                varname[i++] = *p++;
+            } else {
+                while (p < end && (isalnum((unsigned char)*p) || *p == '_') && i < 255) {
+                    varname[i++] = *p++;
+                }
+                if (i == 0) {
+                    /* Not a parameter: "$", "a$ b", "$/" keep the $ */
+                    exp_add(&e, "$", 1, 1);
+                    continue;
+                }
+            }
+            
+            varname[i] = '\0';
+            const char *val = get_var(varname);
+            if (val) exp_add(&e, val, strlen(val), dq);
+        } else if (*p == '~' && !dq && (p == word || p[-1] == ':')) {
+            /* Tilde results are never globbed: quoted */
+            p++;
+            if (p == end || *p == '/') {
+                const char *home = getenv("HOME");
+                if (home) exp_add(&e, home, strlen(home), 1);
+            } else {
+                char username[256];
+                int i = 0;
+                while (p < end && *p != '/' && i < 255) {
+                    username[i++] = *p++;
+                }
+                username[i] = '\0';
+                struct passwd *pw = getpwnam(username);
+                if (pw) exp_add(&e, pw->pw_dir, strlen(pw->pw_dir), 1);
+            }
+        } else {
+            /* Literal run up to the next character with a meaning */
+            size_t n = 1;
+            while (p + n < end && !strchr("$~'\"\\", p[n])) n++;
+            exp_add(&e, p, n, dq);
+            p += n;
+        }
+    }
+    
+    char *result = arena_strndup(&run_arena, e.out.len ? e.out.data : "", e.out.len);
+    if (pattern) {
+        *pattern = NULL;
+        if (e.globs && e.quoted_word) {
+            out_add(&e.pat, "", 1);
+            *pattern = e.pat.data;
+        } else if (e.globs) {
+            *pattern = result;
+        }
+    }
+    return result;
+}
+
+/*
+ * LEXER - TOKEN SPANS OVER THE INPUT
+ * 
+ * Splits text into words and operators without touching it: each
+ * token is (offset, length, kind, quoting) into the caller's text.
+ * Quotes stay in the span and are removed by expand_word(), which
+ * needs to know what was quoted anyway ($ in '...', * in "...").
+ * 
+ *   echo "a b"|wc -l>out    →  WORD echo, WORD "a b" (TQ_DOUBLE),
+ *                              PIPE, WORD wc, WORD -l, GREAT, WORD out
+ * 
+ * Operators: | || & && ; < << > >> ( ). Unquoted blanks end a word,
+ * so does an operator character: `a|b` is three tokens. '#' at the
+ * start of a word comments out the rest of the line.
+ * 
+ * One line per call: from *pos up to and including the next unquoted
+ * newline, which becomes a TK_NEWLINE token (none at the end of the
+ * text); *pos is moved past it. A quote can span lines, and so can a
+ * word through "\⏎" (expand_word() drops it); between words, "\⏎" is
+ * just a blank. The parser asks for the next line when it needs it.
+ * 
+ * Tokens go into tv, reused from line to line: its array only grows
+ * (doubling), so after the first few lines lexing allocates nothing.
+ * No limit on the number of tokens.
+ * 
+ * Speed: a 256-entry class table; a plain word is one tight loop
+ * over LC_WORD bytes, quotes leave it only to find their end
+ * (memchr() for '...').
+ * 
+ * Returns 0, or -1 for a quote the text ends in (no tokens then, *pos
+ * at the end): the caller decides whether more input can close it.
+ */
+enum { LC_WORD, LC_BLANK, LC_OP, LC_QUOTE };
+
+static const unsigned char lex_class[256] = {
+    [' '] = LC_BLANK, ['\t'] = LC_BLANK, ['\r'] = LC_BLANK,
+    ['|'] = LC_OP, ['&'] = LC_OP, [';'] = LC_OP, ['<'] = LC_OP,
+    ['>'] = LC_OP, ['('] = LC_OP, [')'] = LC_OP, ['\n'] = LC_OP,
+    ['\''] = LC_QUOTE, ['"'] = LC_QUOTE, ['\\'] = LC_QUOTE,
+};
+
+static int lex(const char *text, size_t *pos, size_t len, token_vec_t *tv) {
+    const unsigned char *s = (const unsigned char *)text;
+    size_t i = *pos;
+    tv->n = 0;
+    
+    for (;;) {
+        while (i < len && (lex_class[s[i]] == LC_BLANK ||
+                           (s[i] == '\\' && i + 1 < len && s[i + 1] == '\n'))) {
+            i += lex_class[s[i]] == LC_BLANK ? 1 : 2;
+        }
+        if (i < len && s[i] == '#') {
+            const unsigned char *nl = memchr(s + i, '\n', len - i);
+            i = nl ? (size_t)(nl - s) : len;
+        }
+        if (i == len) {
+            *pos = len;
+            return 0;
+        }
+        
+        if (tv->n == tv->cap) {
+            tv->cap = tv->cap ? tv->cap * 2 : 64;
+            tv->v = realloc(tv->v, tv->cap * sizeof(*tv->v));
+            if (!tv->v) die("realloc");
+        }
+        token_t *t = &tv->v[tv->n++];
+        t->off = i;
+        t->quote = 0;
+        
+        if (lex_class[s[i]] == LC_OP) {
+            int twice = i + 1 < len && s[i + 1] == s[i];
+            switch (s[i]) {
+            case '|': t->kind = twice ? TK_OR_IF : TK_PIPE; break;
+            case '&': t->kind = twice ? TK_AND_IF : TK_AMP; break;
+            case '<': t->kind = twice ? TK_DLESS : TK_LESS; break;
+            case '>': t->kind = twice ? TK_DGREAT : TK_GREAT; break;
+            case ';': t->kind = TK_SEMI; twice = 0; break;
+            case '(': t->kind = TK_LPAREN; twice = 0; break;
+            case ')': t->kind = TK_RPAREN; twice = 0; break;
+            default:  t->kind = TK_NEWLINE; twice = 0; break;
+            }
+            t->len = 1 + twice;
+            i += t->len;
+            if (t->kind == TK_NEWLINE) {
+                *pos = i;
+                return 0;
+            }
+            continue;
+        }
+        
+        t->kind = TK_WORD;
+        int open = 0;      /* Quote never closed */
+        for (;;) {
+            while (i < len && lex_class[s[i]] == LC_WORD) i++;
+            if (i == len || lex_class[s[i]] != LC_QUOTE) break;
+            
+            if (s[i] == '\\') {
+                t->quote |= TQ_BACKSLASH;
+                i = i + 2 < len ? i + 2 : len;
+            } else if (s[i] == '\'') {
+                t->quote |= TQ_SINGLE;
+                const unsigned char *q = memchr(s + i + 1, '\'', len - i - 1);
+                if (!q) {
+                    open = 1;
+                    break;
+                }
+                i = q - s + 1;
+            } else {
+                t->quote |= TQ_DOUBLE;
+                for (i++; i < len && s[i] != '"'; i++) {
+                    if (s[i] == '\\') i++;
+                }
+                if (i >= len) {
+                    open = 1;
+                    break;
+                }
+                i++;
+            }
+        }
+        if (open) {
+            tv->n = 0;
+            *pos = len;
+            return -1;
+        }
+        t->len = i - t->off;
+    }
+}
+
+/* Token is exactly this unquoted word (keywords: time, !) */
+static int tok_is(const char *text, const token_t *t, const char *word) {
+    return t->kind == TK_WORD && t->quote == 0 && t->len == strlen(word) &&
+           memcmp(text + t->off, word, t->len) == 0;
+}
+
+/* NAME=... (NAME unquoted: [A-Za-z_][A-Za-z0-9_]*) */
+static int tok_assignment(const char *text, const token_t *t) {
+    const char *w = text + t->off;
+    size_t n = 0;
+    if (t->kind != TK_WORD || !(isalpha((unsigned char)w[0]) || w[0] == '_')) return 0;
+    while (n < t->len && (isalnum((unsigned char)w[n]) || w[n] == '_')) n++;
+    return n < t->len && w[n] == '=';
+}
+
+static void tok_word(const char *text, const token_t *t, pl_op_t *op) {
+    op->word = text + t->off;
+    op->len = t->len;
+    op->quote = t->quote;
+}
+
+/* Reports t (NULL or a newline: end of line); returns 0 */
+static int syntax_error(const char *text, const token_t *t) {
+    if (t && t->kind != TK_NEWLINE) {
+        fprintf(stderr, "mysh: syntax error near unexpected token `%.*s'\n",
+                (int)t->len, text + t->off);
+    } else {
+        fprintf(stderr, "mysh: syntax error near unexpected token `newline'\n");
+    }
+    return 0;
+}
+
+/*
+ * PARSER - SYNTAX ANALYSIS (TOKENS → COMMAND TREE)
+ * ==================================================
+ * 
+ * MENTAL MODEL: Building the Execution Plan
+ * 
+ * Input: Tokens, a line at a time
+ *   ["ls", "-la", "|", "grep", "foo", "&&", "(", "cd", "/tmp", ";", "make", ")"]
+ * 
+ * Output: A tree (node_t) of lists, and-or chains and pipelines
+ *   AND
+ *     left:  PIPELINE  ops: [WORD ls] [WORD -la] [PIPE] [WORD grep] [WORD foo]
+ *     right: PIPELINE  ops: [SUBSHELL "(cd /tmp; make)"]
+ *                             body: PIPELINE cd /tmp → next → PIPELINE make
+ * 
+ * Parser's job:
+ *   1. Recognize operators (| && || ; & newline ( ) < > >>) and
+ *      keywords (!, time)
+ *   2. Group commands into pipelines, pipelines into and-or chains,
+ *      chains into lists
+ *   3. Sort words into assignments, arguments and redirection targets
+ * 
+ * Not its job: expansion. Words stay spans over the text, expanded
+ * (expand_pipeline()) each time their pipeline runs - variables
+ * change between runs, and `a && b` must not expand b if a fails.
+ * So a tree is parsed once and can be run any number of times
+ * (source caches them).
+ * 
+ * Grammar (POSIX shell, the part this shell runs):
+ *   list        := and_or ((; | & | newline) and_or)* [; | &]
+ *   and_or      := pipeline ((&& | ||) linebreak pipeline)*
+ *   pipeline    := [time] [!] command (| linebreak command)*
+ *   command     := ( list ) redirect*
+ *                | (assignment | word | redirect)+
+ *   redirect    := < word | > word | >> word
+ *   assignment  := NAME=word      (before the first word only)
+ *   linebreak   := newline*
+ * 
+ * Recursive descent: one function per rule, each consuming its
+ * tokens and returning its tree (NULL on error). Newlines end a
+ * command line, except after && || | and inside ( ), where they
+ * are skipped - there the line just goes on:
+ * 
+ *   true &&
+ *   echo yes          one command, two lines
+ * 
+ * Text that ends inside a command ("true &&", "(cd /tmp", an open
+ * quote) is PARSE_MORE, not an error: the REPL reads another line
+ * and parses again; a script reports "unexpected end of file".
+ */
+#define PARSE_OK    0
+#define PARSE_ERROR 1      /* Reported already */
+#define PARSE_MORE  2      /* Text ended inside a command */
+
+typedef struct {
+    const char *text;
+    size_t len;
+    size_t pos;            /* Lexed up to here */
+    token_vec_t *tv;       /* The current line's tokens */
+    int i;                 /* Next one */
+    size_t end;            /* Just past the last token taken */
+    int status;            /* PARSE_* */
+    arena_t *arena;        /* Where the tree goes */
+} parser_t;
+
+/*
+ * Ops of the pipelines being parsed, innermost last: a pipeline's
+ * ops are pushed here, then copied to the arena in one piece when it
+ * is complete (its length is only known then). A subshell's
+ * pipelines come and go above the enclosing one's.
+ */
+static pl_op_t *op_stack;
+static int op_top, op_cap;
+
+/* Next token, lexing the next line if needed; NULL at the end (or
+ * after an error). Valid until the next line is lexed. */
+static const token_t *tok_peek(parser_t *p) {
+    while (p->i == p->tv->n) {
+        if (p->status || p->pos >= p->len) return NULL;
+        p->i = 0;
+        if (lex(p->text, &p->pos, p->len, p->tv) < 0) p->status = PARSE_MORE;
+    }
+    return &p->tv->v[p->i];
+}
+
+static const token_t *tok_take(parser_t *p) {
+    const token_t *t = &p->tv->v[p->i++];
+    p->end = t->off + t->len;
+    return t;
+}
+
+static int tok_redirect(int kind) {
+    return kind == TK_LESS || kind == TK_DLESS || kind == TK_GREAT || kind == TK_DGREAT;
+}
+
+/* t unexpected; NULL: the text ended early. Returns 0 */
+static int parse_error(parser_t *p, const token_t *t) {
+    if (p->status) return 0;
+    if (!t) {
+        p->status = PARSE_MORE;
+        return 0;
+    }
+    syntax_error(p->text, t);
+    p->status = PARSE_ERROR;
+    return 0;
+}
+
+/* linebreak: newlines where a command must still follow */
+static void skip_newlines(parser_t *p) {
+    const token_t *t;
+    while ((t = tok_peek(p)) && t->kind == TK_NEWLINE) tok_take(p);
+}
+
+/* Nothing is freed on an error: the arena goes as a whole */
+static node_t *node_new(parser_t *p, node_kind_t kind) {
+    node_t *n = arena_alloc(p->arena, sizeof(*n));
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    return n;
+}
+
+/* Push a zeroed op; good until the next push */
+static pl_op_t *push_op(void) {
+    if (op_top == op_cap) {
+        op_cap = op_cap ? op_cap * 2 : 64;
+        op_stack = realloc(op_stack, op_cap * sizeof(*op_stack));
+        if (!op_stack) die("realloc");
+    }
+    pl_op_t *op = &op_stack[op_top++];
+    memset(op, 0, sizeof(*op));
+    return op;
+}
+
+static node_t *parse_list(parser_t *p, int nested);
+
+/* redirect := < word | > word | >> word (next token is the operator) */
+static int parse_redirect(parser_t *p) {
+    int kind = tok_take(p)->kind;
+    if (kind == TK_DLESS) {
+        fprintf(stderr, "mysh: `<<' is not supported\n");
+        p->status = PARSE_ERROR;
+        return 0;
+    }
+    
+    /* Always on the operator's line: a newline token ends it */
+    const token_t *t = tok_peek(p);
+    if (!t || t->kind != TK_WORD) {
+        if (!p->status) {
+            syntax_error(p->text, t);
+            p->status = PARSE_ERROR;
+        }
+        return 0;
+    }
+    
+    pl_op_t *op = push_op();
+    tok_word(p->text, tok_take(p), op);
+    
+    /* INPUT REDIRECTION: < file
+     *
+     * Example: grep foo < input.txt
+     * Effect: stdin (FD 0) reads from input.txt
+     *
+     * Implementation:
+     *   - Open file with O_RDONLY
+     *   - dup2(filefd, 0) in child before exec
+     *   - File replaces stdin
+     *
+     * Kernel operation:
+     *   open("input.txt", O_RDONLY) → fd 3
+     *   dup2(3, 0) → fd 0 now points to input.txt
+     *   close(3)
+     *   exec("grep") → grep reads from input.txt via stdin
+     */
+    if (kind == TK_LESS) {
+        op->kind = OP_IN;
+    /* OUTPUT REDIRECTION: > file
+     *
+     * Example: echo hello > output.txt
+     * Effect: stdout (FD 1) writes to output.txt
+     *
+     * Flags:
+     *   O_WRONLY: Write-only access
+     *   O_CREAT: Create file if doesn't exist
+     *   O_TRUNC: Truncate file to 0 bytes (overwrite)
+     *
+     * Mode: 0644 (rw-r--r--)
+     *   Owner: read+write
+     *   Group: read
+     *   Other: read
+     *
+     * Kernel operation:
+     *   open("output.txt", O_WRONLY|O_CREAT|O_TRUNC, 0644) → fd 3
+     *   dup2(3, 1) → fd 1 now points to output.txt
+     *   close(3)
+     *   exec("echo") → echo writes to output.txt via stdout
+     */
+    } else if (kind == TK_GREAT) {
+        op->kind = OP_OUT;
+    /* APPEND REDIRECTION: >> file
+     *
+     * Example: echo hello >> output.txt
+     * Effect: stdout appends to output.txt (doesn't overwrite)
+     *
+     * Difference from >:
+     *   >  : O_TRUNC (truncate to 0, overwrite)
+     *   >> : O_APPEND (seek to end, append)
+     *
+     * O_APPEND is atomic:
+     *   - Kernel seeks to end before each write()
+     *   - Multiple processes can append safely
+     *   - No race condition (kernel handles locking)
+     *
+     * Use case:
+     *   while true; do
+     *     echo "$(date)" >> log.txt  # Safe concurrent logging
+     *   done &
+     */
+    } else {
+        op->kind = OP_APPEND;
+    }
+    return 1;
+}
+
+/*
+ * command := ( list ) redirect* | (assignment | word | redirect)+
+ * 
+ * Pushes the command's ops. A subshell is one OP_SUBSHELL
+ * op holding the list's tree; it runs in a child (exec_stage()), so
+ * `(cd /tmp; make)` leaves this shell's directory alone.
+ */
+static int parse_command(parser_t *p) {
+    const token_t *t = tok_peek(p);
+    if (!t) return parse_error(p, NULL);
+    
+    if (t->kind == TK_LPAREN) {
+        size_t start = t->off;
+        tok_take(p);
+        node_t *body = parse_list(p, 1);
+        if (!body) return 0;
+        tok_take(p);       /* ) - parse_list() stopped at it */
+    
+        pl_op_t *op = push_op();
+        op->kind = OP_SUBSHELL;
+        op->word = p->text + start;
+        op->len = p->end - start;
+        op->body = body;
+    
+        while ((t = tok_peek(p)) && tok_redirect(t->kind)) {
+            if (!parse_redirect(p)) return 0;
+        }
+        if (t && (t->kind == TK_WORD || t->kind == TK_LPAREN)) return parse_error(p, t);
+        return 1;
+    }
+    
+    /* Words, assignments and redirections, in any order
+     *
+     * in_assignments: Parsing VAR=value at start of command
+     * After first non-assignment: Switch to parsing arguments
+     *
+     * Why track assignments separately?
+     *   - VAR=value at start: Variable assignment
+     *   - VAR=value after command: Regular argument
+     *   Example:
+     *     FOO=bar echo $FOO     # FOO set for echo only
+     *     echo FOO=bar          # FOO=bar is argument to echo
+     *
+     * Decided here, once: expand_pipeline() never looks at a token's
+     * text to know what it is. Validity is checked after expansion.
+     */
+    int in_assignments = 1;
+    int base = op_top;
+    
+    while ((t = tok_peek(p))) {
+        if (tok_redirect(t->kind)) {
+            if (!parse_redirect(p)) return 0;
+            continue;
+        }
+        if (t->kind != TK_WORD) break;
+    
+        pl_op_t *op = push_op();
+        tok_word(p->text, t, op);
+    
+        /* VARIABLE ASSIGNMENT: VAR=value
+         *
+         * Example: FOO=bar echo $FOO
+         * Effect: Sets FOO for this command only
+         *
+         * in_assignments flag:
+         *   - True at start of command
+         *   - False after first non-assignment
+         */
+        if (in_assignments && tok_assignment(p->text, t)) {
+            op->kind = OP_ASSIGN;
+        } else {
+            /* COMMAND ARGUMENT
+             *
+             * Once we see non-assignment, all remaining tokens are arguments
+             */
+            in_assignments = 0;
+            op->kind = OP_WORD;
+        }
+        tok_take(p);
+    }
+    
+    /* Nothing: "| b", "a && ; b", ";;", ")" */
+    if (op_top == base) return parse_error(p, t);
+    return 1;
+}
+
+/*
+ * pipeline := [time] [!] command (| linebreak command)*
+ * 
+ * One ND_PIPELINE node; its code is what expand_pipeline() turns into
+ * a pipeline_t at run time.
+ */
+static node_t *parse_pipeline(parser_t *p) {
+    node_t *n = node_new(p, ND_PIPELINE);
+    pl_code_t *code = &n->code;
+    int base = op_top;
+    const token_t *t = tok_peek(p);
+    
+    /* STEP 0: time keyword (POSIX: "time [!] pipeline")
+     *
+     * A reserved word, not a command: it wraps the whole pipeline,
+     * so "time a | b" times both stages (an external /usr/bin/time
+     * would only see "a"). Followed by nothing, it's a command name.
+     */
+    if (t && tok_is(p->text, t, "time") && p->i + 1 < p->tv->n &&
+        (p->tv->v[p->i + 1].kind == TK_WORD || p->tv->v[p->i + 1].kind == TK_LPAREN ||
+         tok_redirect(p->tv->v[p->i + 1].kind))) {
+        code->timed = 1;
+        tok_take(p);
+        t = tok_peek(p);
+    }
+    
+    /* STEP 1: Check for negation (!)
+     *
+     * Example: ! grep foo file
+     * Effect: Inverts exit status (0→1, 1→0)
+     *
+     * Use case:
+     *   if ! grep pattern file; then
+     *     echo "pattern not found"
+     *   fi
+     *
+     * Only here, at the start: "a | ! b" is a syntax error.
+     */
+    if (t && tok_is(p->text, t, "!")) {
+        code->negate = 1;
+        tok_take(p);
+    }
+    
+    /* STEP 2: Commands separated by |
+     *
+     * Example: ls | grep foo
+     *          ^   ^
+     *          cmd0 cmd1
+     *
+     * Effect (in expand_pipeline()):
+     *   - Finalize current command (NULL-terminate args)
+     *   - Start new command
+     *   - Reset to assignment parsing mode
+     */
+    for (;;) {
+        if (!parse_command(p)) break;
+        
+        t = tok_peek(p);
+        if (!t || t->kind != TK_PIPE) {
+            code->nops = op_top - base;
+            code->ops = arena_alloc(p->arena, code->nops * sizeof(pl_op_t));
+            memcpy(code->ops, op_stack + base, code->nops * sizeof(pl_op_t));
+            op_top = base;
+            return n;
+        }
+        
+        pl_op_t *op = push_op();
+        op->kind = OP_PIPE;
+        op->word = "|";
+        op->len = 1;
+        tok_take(p);
+        skip_newlines(p);
+    
+        t = tok_peek(p);
+        if (t && tok_is(p->text, t, "!")) {
+            parse_error(p, t);
+            break;
+        }
+    }
+    op_top = base;
+    return NULL;
+}
+
+/*
+ * and_or := pipeline ((&& | ||) linebreak pipeline)*
+ * 
+ * Left-associative, equal precedence, as POSIX has it:
+ * 
+ *   a || b && c   →   AND(OR(a, b), c)    c runs if a or b succeeded
+ */
+static node_t *parse_and_or(parser_t *p) {
+    node_t *left = parse_pipeline(p);
+    const token_t *t;
     
-    if (interactive) {
-        tcsetpgrp(shell_terminal, shell_pgid);
+    while (left && (t = tok_peek(p)) && (t->kind == TK_AND_IF || t->kind == TK_OR_IF)) {
+        node_t *n = node_new(p, t->kind == TK_AND_IF ? ND_AND : ND_OR);
+        tok_take(p);
+        skip_newlines(p);
+        n->left = left;
+        n->right = parse_pipeline(p);
+        left = n->right ? n : NULL;
+    }
+    return left;
+}
+
+/*
+ * "a && b &": the whole chain is the background job. A job is a
+ * pipeline, so the chain becomes a one-stage pipeline running it in
+ * a subshell, labelled with its text (p->text[start..p->end)).
+ */
+static node_t *background(parser_t *p, node_t *n, size_t start) {
+    if (n->kind == ND_PIPELINE) {
+        n->code.background = 1;
+        return n;
     }
     
-    return pl->negate ? !status : status;
+    node_t *job = node_new(p, ND_PIPELINE);
+    pl_op_t *op = arena_alloc(p->arena, sizeof(*op));
+    memset(op, 0, sizeof(*op));
+    job->code.ops = op;
+    job->code.nops = 1;
+    op->kind = OP_SUBSHELL;
+    op->word = p->text + start;
+    op->len = p->end - start;
+    op->body = n;
+    job->code.background = 1;
+    return job;
 }
 
 /*
- * EXPANSION
+ * list := and_or ((; | & | newline) and_or)* [; | &]
  * 
- * Handles: $VAR, ${VAR}, ~, ~user
- * Returns newly allocated string.
+ * Top level (nested 0): up to the end of the line, newline not
+ * taken. Inside ( ) (nested 1): up to the ), across lines, ) not
+ * taken; an empty one is an error. Linked through node_t.next.
  */
-static char *expand_word(const char *word) {
-    static char buf[MAX_LINE];
-    char *out = buf;
-    const char *p = word;
+static node_t *parse_list(parser_t *p, int nested) {
+    node_t *head = NULL;
+    node_t **tail = &head;
+    const token_t *t;
     
-    while (*p && out < buf + MAX_LINE - 1) {
-        if (*p == '$') {
-            p++;
-            char varname[256];
-            int i = 0;
-            
-            if (*p == '{') {
-                p++;
-                while (*p && *p != '}' && i < 255) {
-                    varname[i++] = *p++;
-                }
-                if (*p == '}') p++;
-            } else {
-                while (*p && (isalnum(*p) || *p == '_' || *p == '?' || *p == '$' || *p == '!') && i < 255) {
-                    varname[i++] = *p++;
-                }
-            }
-            
-            varname[i] = '\0';
-            const char *val = get_var(varname);
-            if (val) {
-                while (*val && out < buf + MAX_LINE - 1) {
-                    *out++ = *val++;
-                }
-            }
-        } else if (*p == '~' && (p == word || *(p-1) == ':')) {
-            p++;
-            if (*p == '/' || *p == '\0') {
-                const char *home = getenv("HOME");
-                if (home) {
-                    while (*home && out < buf + MAX_LINE - 1) {
-                        *out++ = *home++;
-                    }
-                }
-            } else {
-                char username[256];
-                int i = 0;
-                while (*p && *p != '/' && i < 255) {
-                    username[i++] = *p++;
-                }
-                username[i] = '\0';
-                struct passwd *pw = getpwnam(username);
-                if (pw) {
-                    const char *home = pw->pw_dir;
-                    while (*home && out < buf + MAX_LINE - 1) {
-                        *out++ = *home++;
-                    }
-                }
-            }
-        } else {
-            *out++ = *p++;
+    for (;;) {
+        if (nested) skip_newlines(p);
+        t = tok_peek(p);
+        if (!t || t->kind == TK_NEWLINE || (nested && t->kind == TK_RPAREN)) break;
+    
+        size_t start = t->off;
+        node_t *n = parse_and_or(p);
+        if (!n) return NULL;
+    
+        t = tok_peek(p);
+        if (t && t->kind == TK_AMP) n = background(p, n, start);
+        *tail = n;
+        tail = &n->next;
+    
+        if (!t) break;
+        if (t->kind == TK_SEMI || t->kind == TK_AMP) {
+            tok_take(p);
+        } else if (t->kind != TK_NEWLINE && !(nested && t->kind == TK_RPAREN)) {
+            parse_error(p, t);
+            return NULL;
         }
     }
     
-    *out = '\0';
-    return strdup(buf);
+    if (p->status) return NULL;
+    if (nested && (!t || !head)) {
+        parse_error(p, t);       /* "(a" at the end, or "()" */
+        return NULL;
+    }
+    return head;
 }
 
 /*
- * TOKENIZER
+ * Parse s->text[start..s->len) into s->cmds, one list per command
+ * line (a line, or more when a command goes on: "a &&⏎b"), dropping
+ * what s held. Returns PARSE_*.
  * 
- * Splits input on whitespace, handles quotes and escapes.
- * Returns NULL-terminated array.
+ * recover (scripts): after a syntax error, report it, skip the rest
+ * of that line and go on; an unfinished command at the end is
+ * reported too. Otherwise (the REPL) the first problem ends it, and
+ * PARSE_MORE is for the caller to handle.
  */
-static char **tokenize(char *line, int *ntokens) {
-    static char *tokens[MAX_ARGS];
-    *ntokens = 0;
+static int parse_commands(script_t *s, size_t start, int recover) {
+    static token_vec_t tv;
+    parser_t p = { s->text, s->len, start, &tv, 0, start, PARSE_OK, &s->arena };
+    tv.n = 0;
+    op_top = 0;
+    script_clear(s);
     
-    char *p = line;
-    while (*p && *ntokens < MAX_ARGS - 1) {
-        while (*p && isspace(*p)) p++;
-        if (!*p) break;
-        
-        tokens[(*ntokens)++] = p;
-        
-        int in_quote = 0;
-        while (*p && (in_quote || !isspace(*p))) {
-            if (*p == '"' || *p == '\'') {
-                in_quote = !in_quote;
+    while (tok_peek(&p)) {
+        node_t *n = parse_list(&p, 0);
+        if (n) {
+            if (s->ncmds == s->cmds_cap) {
+                s->cmds_cap = s->cmds_cap ? s->cmds_cap * 2 : 16;
+                s->cmds = realloc(s->cmds, s->cmds_cap * sizeof(*s->cmds));
+                if (!s->cmds) die("realloc");
             }
-            p++;
+            s->cmds[s->ncmds++] = n;
         }
-        
-        if (*p) *p++ = '\0';
+        if (p.status == PARSE_ERROR && recover) {
+            while (p.i < tv.n && tv.v[p.i++].kind != TK_NEWLINE) {}
+            p.status = PARSE_OK;
+            continue;
+        }
+        if (p.status) break;
+        if (tok_peek(&p)) tok_take(&p);     /* The newline */
     }
     
-    tokens[*ntokens] = NULL;
-    return tokens;
+    if (p.status == PARSE_MORE && recover) {
+        fprintf(stderr, "mysh: syntax error: unexpected end of file\n");
+    }
+    return p.status;
 }
 
 /*
- * PARSER - SYNTAX ANALYSIS (TOKENS → PIPELINE STRUCTURE)
- * ========================================================
- * 
- * MENTAL MODEL: Building the Execution Plan
+ * What expand_pipeline() collects before it knows the sizes: argv
+ * words of every command (each run NULL-terminated), redirections and
+ * commands, in order. Kept from run to run, grown to the largest
+ * pipeline seen; the result is copied out in one piece.
+ */
+static struct {
+    char **args;
+    redirect_t *redirects;
+    command_t *cmds;
+    size_t nargs, nredirects, ncmds;
+    size_t args_cap, redirects_cap, cmds_cap;
+} xp;
+
+/* v with room for element n (of size bytes), *cap grown as needed */
+static void *xp_room(void *v, size_t *cap, size_t n, size_t size) {
+    if (n < *cap) return v;
+    *cap = *cap ? *cap * 2 : 64;
+    v = realloc(v, *cap * size);
+    if (!v) die("realloc");
+    return v;
+}
+
+static void xp_arg(char *word) {
+    xp.args = xp_room(xp.args, &xp.args_cap, xp.nargs, sizeof(*xp.args));
+    xp.args[xp.nargs++] = word;
+    if (word) xp.cmds[xp.ncmds - 1].argc++;
+}
+
+static redirect_t *xp_redirect(void) {
+    xp.redirects = xp_room(xp.redirects, &xp.redirects_cap, xp.nredirects,
+                           sizeof(*xp.redirects));
+    xp.cmds[xp.ncmds - 1].nredirects++;
+    return &xp.redirects[xp.nredirects++];
+}
+
+static void xp_command(void) {
+    xp.cmds = xp_room(xp.cmds, &xp.cmds_cap, xp.ncmds, sizeof(*xp.cmds));
+    memset(&xp.cmds[xp.ncmds++], 0, sizeof(*xp.cmds));
+}
+
+/*
+ * EXPANSION PASS - OPS → pipeline_t
  * 
- * Input: Array of tokens (strings)
- *   ["ls", "-la", "|", "grep", "foo", ">", "out.txt", "&"]
+ * Runs every time the pipeline runs (variables change between runs),
+ * so this is all it does: apply assignments, expand words and
+ * redirection targets, glob, and fill in argv. A subshell stage is
+ * left as it is: its list is expanded by the child that runs it.
  * 
- * Output: Pipeline structure
- *   pipeline_t {
- *     ncmds = 2
- *     cmds[0] = {args: ["ls", "-la"], argc: 2}
- *     cmds[1] = {args: ["grep", "foo"], argc: 2, redirects: [{fd:1, file:"out.txt"}]}
- *     background = 1
- *   }
+ * Every string goes into run_arena, and so does the pipeline's
+ * layout (see pipeline_t), sized to what the words expanded to: the
+ * caller marks it before and releases it after the run, nothing is
+ * freed one by one.
  * 
- * Parser's job:
- *   1. Recognize special tokens (|, <, >, >>, &, !)
- *   2. Split pipeline into commands
- *   3. Collect arguments for each command
- *   4. Parse redirections
- *   5. Handle variable assignments
- *   6. Expand variables and globs
- * 
- * Grammar (simplified POSIX shell):
- *   pipeline    := [!] command [| command]* [&]
- *   command     := [assignment]* word [word | redirect]*
- *   redirect    := < file | > file | >> file
- *   assignment  := VAR=value
- * 
- * Why parse?
- *   - Tokens are just strings
- *   - Need structure for execution
- *   - Identify pipes, redirections, background
- *   - Separate commands in pipeline
- * 
- * Parsing is a state machine:
- *   State 1: Looking for ! (negation)
- *   State 2: Looking for & at end (background)
- *   State 3: Parsing commands
- *     Sub-state A: Parsing variable assignments
- *     Sub-state B: Parsing arguments
- *     Sub-state C: Parsing redirections
- *   State 4: Validation
- */
-static int parse_pipeline(char **tokens, int ntokens, pipeline_t *pl) {
-    /* Initialize pipeline structure
-     * All fields start at 0/NULL
-     */
-    pl->ncmds = 0;        /* Number of commands in pipeline */
-    pl->negate = 0;       /* ! prefix (invert exit status) */
-    pl->background = 0;   /* & suffix (run in background) */
-    
-    int i = 0;  /* Token index */
-    
-    /* STEP 1: Check for negation (!)
-     * 
-     * Example: ! grep foo file
-     * Effect: Inverts exit status (0→1, 1→0)
-     * 
-     * Use case:
-     *   if ! grep pattern file; then
-     *     echo "pattern not found"
-     *   fi
-     */
-    if (ntokens > 0 && strcmp(tokens[0], "!") == 0) {
-        pl->negate = 1;
-        i++;  /* Skip ! token */
-    }
-    
-    /* STEP 2: Check for background (&)
-     * 
-     * Example: sleep 100 &
-     * Effect: Shell doesn't wait for completion
-     * 
-     * Implementation:
-     *   - & must be last token
-     *   - Remove it from token list
-     *   - Set background flag
-     *   - execute_pipeline() will skip waitpid()
-     */
-    if (ntokens > 0 && strcmp(tokens[ntokens - 1], "&") == 0) {
-        pl->background = 1;
-        ntokens--;  /* Remove & from consideration */
-    }
+ * Returns 1 (something to run) or 0 (assignments only).
+ */
+static int expand_pipeline(const pl_code_t *code, pipeline_t *pl) {
+    pl->negate = code->negate;
+    pl->background = code->background;
+    pl->timed = code->timed;
     
-    /* STEP 3: Initialize first command
+    /* Initialize first command
      * 
      * Pipeline can have multiple commands (separated by |)
      * Start with first command
      */
-    command_t *cmd = &pl->cmds[pl->ncmds++];
-    cmd->argc = 0;         /* Argument count */
-    cmd->nredirects = 0;   /* Redirection count */
-    
-    /* STEP 4: Parse tokens into commands
-     * 
-     * State machine:
-     *   in_assignments: Parsing VAR=value at start of command
-     *   After first non-assignment: Switch to parsing arguments
-     * 
-     * Why track assignments separately?
-     *   - VAR=value at start: Variable assignment
-     *   - VAR=value after command: Regular argument
-     *   Example:
-     *     FOO=bar echo $FOO     # FOO set for echo only
-     *     echo FOO=bar          # FOO=bar is argument to echo
-     */
-    int in_assignments = 1;
+    xp.nargs = xp.nredirects = xp.ncmds = 0;
+    xp_command();
     
-    /* Main parsing loop: Process each token */
-    for (; i < ntokens; i++) {
-        /* PIPE: Start new command
-         * 
-         * Example: ls | grep foo
-         *          ^   ^
-         *          cmd0 cmd1
-         * 
-         * Effect:
-         *   - Finalize current command (NULL-terminate args)
-         *   - Start new command
-         *   - Reset to assignment parsing mode
-         */
-        if (strcmp(tokens[i], "|") == 0) {
-            cmd->args[cmd->argc] = NULL;  /* NULL-terminate argv */
-            cmd = &pl->cmds[pl->ncmds++]; /* Next command */
-            cmd->argc = 0;
-            cmd->nredirects = 0;
-            in_assignments = 1;  /* New command can have assignments */
-        /* INPUT REDIRECTION: < file
-         * 
-         * Example: grep foo < input.txt
-         * Effect: stdin (FD 0) reads from input.txt
-         * 
-         * Implementation:
-         *   - Open file with O_RDONLY
-         *   - dup2(filefd, 0) in child before exec
-         *   - File replaces stdin
-         * 
-         * Kernel operation:
-         *   open("input.txt", O_RDONLY) → fd 3
-         *   dup2(3, 0) → fd 0 now points to input.txt
-         *   close(3)
-         *   exec("grep") → grep reads from input.txt via stdin
-         */
-        } else if (strcmp(tokens[i], "<") == 0 && i + 1 < ntokens) {
-            cmd->redirects[cmd->nredirects].fd = 0;  /* stdin */
-            cmd->redirects[cmd->nredirects].file = expand_word(tokens[++i]);
-            cmd->redirects[cmd->nredirects].flags = O_RDONLY;
-            cmd->nredirects++;
-        /* OUTPUT REDIRECTION: > file
-         * 
-         * Example: echo hello > output.txt
-         * Effect: stdout (FD 1) writes to output.txt
-         * 
-         * Flags:
-         *   O_WRONLY: Write-only access
-         *   O_CREAT: Create file if doesn't exist
-         *   O_TRUNC: Truncate file to 0 bytes (overwrite)
-         * 
-         * Mode: 0644 (rw-r--r--)
-         *   Owner: read+write
-         *   Group: read
-         *   Other: read
-         * 
-         * Kernel operation:
-         *   open("output.txt", O_WRONLY|O_CREAT|O_TRUNC, 0644) → fd 3
-         *   dup2(3, 1) → fd 1 now points to output.txt
-         *   close(3)
-         *   exec("echo") → echo writes to output.txt via stdout
-         */
-        } else if (strcmp(tokens[i], ">") == 0 && i + 1 < ntokens) {
-            cmd->redirects[cmd->nredirects].fd = 1;  /* stdout */
-            cmd->redirects[cmd->nredirects].file = expand_word(tokens[++i]);
-            cmd->redirects[cmd->nredirects].flags = O_WRONLY | O_CREAT | O_TRUNC;
-            cmd->redirects[cmd->nredirects].mode = 0644;
-            cmd->nredirects++;
-        /* APPEND REDIRECTION: >> file
-         * 
-         * Example: echo hello >> output.txt
-         * Effect: stdout appends to output.txt (doesn't overwrite)
-         * 
-         * Difference from >:
-         *   >  : O_TRUNC (truncate to 0, overwrite)
-         *   >> : O_APPEND (seek to end, append)
-         * 
-         * O_APPEND is atomic:
-         *   - Kernel seeks to end before each write()
-         *   - Multiple processes can append safely
-         *   - No race condition (kernel handles locking)
-         * 
-         * Use case:
-         *   while true; do
-         *     echo "$(date)" >> log.txt  # Safe concurrent logging
-         *   done &
-         */
-        } else if (strcmp(tokens[i], ">>") == 0 && i + 1 < ntokens) {
-            cmd->redirects[cmd->nredirects].fd = 1;  /* stdout */
-            cmd->redirects[cmd->nredirects].file = expand_word(tokens[++i]);
-            cmd->redirects[cmd->nredirects].flags = O_WRONLY | O_CREAT | O_APPEND;
-            cmd->redirects[cmd->nredirects].mode = 0644;
-            cmd->nredirects++;
-        } else {
-            /* REGULAR TOKEN: Variable assignment or argument
+    for (int k = 0; k < code->nops; k++) {
+        const pl_op_t *op = &code->ops[k];
+        redirect_t *r;
+        
+        switch (op->kind) {
+        case OP_PIPE:
+            xp_arg(NULL);  /* NULL-terminate argv */
+            xp_command();  /* Next command */
+            break;
+        case OP_SUBSHELL:
+            xp.cmds[xp.ncmds - 1].subshell = op;
+            break;
+        case OP_IN:
+            r = xp_redirect();
+            r->fd = 0;  /* stdin */
+            r->file = expand_word(op->word, op->len, op->quote, NULL);
+            r->flags = O_RDONLY;
+            r->mode = 0;
+            break;
+        case OP_OUT:
+        case OP_APPEND:
+            r = xp_redirect();
+            r->fd = 1;  /* stdout */
+            r->file = expand_word(op->word, op->len, op->quote, NULL);
+            r->flags = O_WRONLY | O_CREAT |
+                       (op->kind == OP_OUT ? O_TRUNC : O_APPEND);
+            r->mode = 0644;
+            break;
+        case OP_ASSIGN: {
+            /* NAME=value: the value is expanded (no glob), quotes
+             * removed: X="a b" sets a b */
+            const char *eq = memchr(op->word, '=', op->len);
+            char *name = arena_strndup(&run_arena, op->word, eq - op->word);
+            char *value = expand_word(eq + 1, op->len - (eq + 1 - op->word),
+                                      op->quote, NULL);
+            set_var(name, value, 0);  /* exported=0 (local) */
+            break;
+        }
+        case OP_WORD: {
+            /* EXPANSION: $VAR, ~, globs
+             * 
+             * expand_word() handles:
+             *   - $VAR → value of VAR
+             *   - ${VAR} → value of VAR
+             *   - ~ → $HOME
+             *   - ~user → /home/user
              * 
-             * Two cases:
-             *   1. VAR=value at start of command → Variable assignment
-             *   2. Everything else → Command argument
+             * Example:
+             *   Input:  "$HOME/file.txt"
+             *   Output: "/home/user/file.txt"
              */
+            char *pattern;
+            char *expanded = expand_word(op->word, op->len, op->quote, &pattern);
             
-            /* VARIABLE ASSIGNMENT: VAR=value
+            /* GLOB EXPANSION: *, ?, [...]
+             * 
+             * glob() - library function using getdents64() syscall
+             * 
+             * Example:
+             *   Input:  "*.txt"
+             *   Output: ["a.txt", "b.txt", "c.txt"]
              * 
-             * Example: FOO=bar echo $FOO
-             * Effect: Sets FOO for this command only
+             * No match: the word itself (quotes removed), as if
+             * GLOB_NOCHECK, which would give back the escaped pattern.
+             * Only unquoted * and ? glob: echo "f*" prints f*.
              * 
-             * in_assignments flag:
-             *   - True at start of command
-             *   - False after first non-assignment
+             * Implementation:
+             *   1. glob() reads directory with getdents64()
+             *   2. Matches each entry against pattern
+             *   3. Sorts results lexicographically
+             *   4. Returns array of matched paths
              * 
-             * Why?
-             *   FOO=bar BAZ=qux echo $FOO  # FOO and BAZ are assignments
-             *   echo FOO=bar               # FOO=bar is argument
+             * Why glob in shell, not in program?
+             *   - Shell expands before exec
+             *   - Program sees expanded arguments
+             *   - Example: ls *.txt
+             *     Shell: exec("ls", ["ls", "a.txt", "b.txt"])
+             *     ls sees: argv = ["ls", "a.txt", "b.txt"]
+             *     ls doesn't know about glob!
              */
-            if (in_assignments && strchr(tokens[i], '=')) {
-                char *eq = strchr(tokens[i], '=');
-                *eq = '\0';  /* Split at = */
-                set_var(tokens[i], eq + 1, 0);  /* exported=0 (local) */
-                *eq = '=';   /* Restore original token */
-            } else {
-                /* COMMAND ARGUMENT
-                 * 
-                 * Once we see non-assignment, all remaining tokens are arguments
-                 */
-                in_assignments = 0;
-                
-                /* EXPANSION: $VAR, ~, globs
-                 * 
-                 * expand_word() handles:
-                 *   - $VAR → value of VAR
-                 *   - ${VAR} → value of VAR
-                 *   - ~ → $HOME
-                 *   - ~user → /home/user
-                 * 
-                 * Example:
-                 *   Input:  "$HOME/file.txt"
-                 *   Output: "/home/user/file.txt"
-                 */
-                char *expanded = expand_word(tokens[i]);
-                
-                /* GLOB EXPANSION: *, ?, [...]
-                 * 
-                 * glob() - library function using getdents64() syscall
-                 * 
-                 * Example:
-                 *   Input:  "*.txt"
-                 *   Output: ["a.txt", "b.txt", "c.txt"]
-                 * 
-                 * Flags:
-                 *   GLOB_NOCHECK: If no match, return pattern itself
-                 *   (Without this, "*.txt" with no matches → error)
-                 * 
-                 * Implementation:
-                 *   1. glob() reads directory with getdents64()
-                 *   2. Matches each entry against pattern
-                 *   3. Sorts results lexicographically
-                 *   4. Returns array of matched paths
-                 * 
-                 * Why glob in shell, not in program?
-                 *   - Shell expands before exec
-                 *   - Program sees expanded arguments
-                 *   - Example: ls *.txt
-                 *     Shell: exec("ls", ["ls", "a.txt", "b.txt"])
-                 *     ls sees: argv = ["ls", "a.txt", "b.txt"]
-                 *     ls doesn't know about glob!
-                 */
-                if (strchr(expanded, '*') || strchr(expanded, '?')) {
-                    glob_t globbuf;
-                    if (glob(expanded, GLOB_NOCHECK, NULL, &globbuf) == 0) {
-                        /* Add all matched files as separate arguments */
-                        for (size_t j = 0; j < globbuf.gl_pathc && cmd->argc < MAX_ARGS - 1; j++) {
-                            cmd->args[cmd->argc++] = strdup(globbuf.gl_pathv[j]);
-                        }
-                        globfree(&globbuf);  /* Free glob results */
-                    }
-                    free(expanded);
-                } else {
-                    /* No glob characters, use as-is */
-                    cmd->args[cmd->argc++] = expanded;
+            glob_t globbuf;
+            if (pattern && glob(pattern, 0, NULL, &globbuf) == 0) {
+                /* Add all matched files as separate arguments */
+                for (size_t j = 0; j < globbuf.gl_pathc; j++) {
+                    const char *path = globbuf.gl_pathv[j];
+                    xp_arg(arena_strndup(&run_arena, path, strlen(path)));
                 }
+                globfree(&globbuf);  /* Free glob results */
+                break;
             }
+            
+            /* No glob characters (or no match), use as-is */
+            xp_arg(expanded);
+            break;
+        }
         }
     }
     
-    /* STEP 5: Finalize last command
+    /* Finalize last command
      * 
      * NULL-terminate argv array
      * execv() expects NULL-terminated array:
@@ -1610,23 +6707,99 @@ static int parse_pipeline(char **tokens, int ntokens, pipeline_t *pl) {
      *   - Needs to know where array ends
      *   - Scans until NULL
      */
-    cmd->args[cmd->argc] = NULL;
+    xp_arg(NULL);
+    
+    /* Lay the pipeline out in run_arena: commands, argv pool,
+     * redirections, one after the other (all pointer-aligned), then
+     * point each command at its slices */
+    size_t cmds_size = xp.ncmds * sizeof(*xp.cmds);
+    size_t args_size = xp.nargs * sizeof(*xp.args);
+    char *block = arena_alloc(&run_arena, cmds_size + args_size +
+                              xp.nredirects * sizeof(*xp.redirects));
+    char **args = (char **)(block + cmds_size);
+    redirect_t *redirects = (redirect_t *)(block + cmds_size + args_size);
+    memcpy(block, xp.cmds, cmds_size);
+    memcpy(args, xp.args, args_size);
+    if (xp.nredirects) {   /* xp.redirects may still be NULL */
+        memcpy(redirects, xp.redirects, xp.nredirects * sizeof(*xp.redirects));
+    }
+    pl->cmds = (command_t *)block;
+    pl->ncmds = xp.ncmds;
+    for (int i = 0; i < pl->ncmds; i++) {
+        command_t *cmd = &pl->cmds[i];
+        cmd->args = args;
+        cmd->redirects = redirects;
+        args += cmd->argc + 1;
+        redirects += cmd->nredirects;
+    }
     
-    /* STEP 6: Validate pipeline
+    /* Validate pipeline
      * 
      * Valid if:
      *   - At least one command
-     *   - First command has arguments OR redirections
+     *   - First command has arguments, redirections or a subshell
      * 
      * Examples:
      *   Valid:   "ls -la"           (has args)
      *   Valid:   "< input.txt"      (has redirect)
-     *   Invalid: ""                 (empty)
-     *   Invalid: "| grep foo"       (starts with pipe)
+     *   Valid:   "(cd /tmp; ls)"    (subshell)
+     *   Nothing: "FOO=bar"          (assignments only, done above)
      * 
-     * Returns: 1 if valid, 0 if invalid
+     * ("| grep foo" never gets here: a syntax error)
+     * 
+     * Returns: 1 if valid, 0 if nothing to run
      */
-    return pl->ncmds > 0 && (pl->cmds[0].argc > 0 || pl->cmds[0].nredirects > 0);
+    return pl->ncmds > 0 && (pl->cmds[0].argc > 0 || pl->cmds[0].nredirects > 0 ||
+                             pl->cmds[0].subshell);
+}
+
+/*
+ * EXECUTING A TREE
+ * 
+ * Walks what the parser built; each pipeline is expanded just before
+ * it runs, so in
+ * 
+ *   cd /tmp && echo $PWD
+ * 
+ * $PWD is read after the cd, and in "false && FOO=bar" FOO is never
+ * set. $? is last_status throughout.
+ * 
+ * Each pipeline run is an arena scope: its commands, argv and
+ * redirections and every word expanded for it come from run_arena
+ * and go with one arena_release(). What outlives the run is copied
+ * out by its owner (variables, job text).
+ */
+static int run_node(const node_t *n) {
+    switch (n->kind) {
+    case ND_AND:
+        if (run_node(n->left) == 0) run_node(n->right);
+        break;
+    case ND_OR:
+        if (run_node(n->left) != 0) run_node(n->right);
+        break;
+    case ND_PIPELINE: {
+        arena_mark_t mark = arena_mark(&run_arena);
+        pipeline_t pl;
+        
+        /* New command: earlier ones may have changed files */
+        stat_cache_clear();
+        
+        if (expand_pipeline(&n->code, &pl)) {
+            last_status = execute_pipeline(&pl);
+        } else {
+            last_status = n->code.negate;  /* FOO=bar alone succeeds */
+        }
+        arena_release(&run_arena, mark);
+        break;
+    }
+    }
+    return last_status;
+}
+
+/* a; b & c: each in turn (& only doesn't wait) */
+static int run_list(const node_t *n) {
+    for (; n; n = n->next) run_node(n);
+    return last_status;
 }
 
 /*
@@ -1722,8 +6895,12 @@ static int parse_pipeline(char **tokens, int ntokens, pipeline_t *pl) {
  *   - Reading from file or pipe
  *   - No job control needed
  *   - Simpler execution model
+ * 
+ * script: commands come from -c or a file, not stdin. Never
+ * interactive then, even with stdin on a terminal: no process group,
+ * tcsetpgrp() or termios work, and stdin is left to the commands.
  */
-static void init_shell(void) {
+static void init_shell(int script) {
     /* shell_terminal: FD for controlling terminal
      * STDIN_FILENO = 0 (standard input)
      * We assume stdin is the controlling terminal
@@ -1748,7 +6925,11 @@ static void init_shell(void) {
      *   - Script: stdin is file → disable job control
      *   - Pipe: stdin is pipe → disable job control
      */
-    interactive = isatty(shell_terminal);
+    interactive = !script && isatty(shell_terminal);
+    if (script) stdin_is_input = 0;
+    
+    /* Event loop (job tracking, input, signals) for every shell */
+    init_events();
     
     if (interactive) {
         /* STEP 1: Put shell in its own process group
@@ -1812,6 +6993,22 @@ static void init_shell(void) {
          */
         init_signals();
     }
+    
+    /* STEP 5: Options from the environment (SHELLOPTS=a:b)
+     * 
+     * Done last but before any command runs: the zygote forked here
+     * is a copy of a still-small shell.
+     */
+    const char *opts = getenv("SHELLOPTS");
+    for (const shell_option_t *o = shell_options; opts && o->name; o++) {
+        size_t len = strlen(o->name);
+        for (const char *p = opts; (p = strstr(p, o->name)); p += len) {
+            if ((p == opts || p[-1] == ':') && (p[len] == '\0' || p[len] == ':')) {
+                set_option(o->name, 1);
+                break;
+            }
+        }
+    }
 }
 
 /*
@@ -1866,13 +7063,52 @@ static void init_shell(void) {
  *     parse_input();         // Eval (part 1)
  *     execute_command();     // Eval (part 2)
  *   }
+ * 
+ * Invocation:
+ *   mysh                          REPL on stdin (interactive on a TTY)
+ *   mysh -c 'cmds' [name args...] run cmds; $0 = name, $1... = args
+ *   mysh script.sh [args...]      run the file; $0 = script.sh
+ * 
+ * The last two never read commands from stdin. The whole text is
+ * parsed up front (script_parse(), as for source), the file through
+ * mmap() rather than read() into a 4 KiB line buffer; each command
+ * is then only expanded and run. Exit status is
+ * the last command's, 127 if the script can't be found.
  */
-int main(void) {
-    /* Line buffer for user input
-     * Stack allocation: 4KB buffer
-     * Could overflow with very long lines (use getline() for production)
-     */
-    char line[MAX_LINE];
+#if !defined(LEX_BENCH) && !defined(SOAK_TEST)
+int main(int argc, char **argv) {
+    script_t *script = NULL;
+    
+    pos_args = argv;
+    npos_args = 1;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+            return 2;
+        }
+        script = script_parse(strdup(argv[2]), strlen(argv[2]), 0);
+        if (argc > 3) {
+            pos_args = argv + 3;
+            npos_args = argc - 3;
+        }
+    } else if (argc > 1 && argv[1][0] == '-') {
+        fprintf(stderr, "usage: %s [-c command [name [arg...]] | file [arg...]]\n", argv[0]);
+        return 2;
+    } else if (argc > 1) {
+        struct stat st;
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            if (S_ISREG(st.st_mode)) script = script_map(fd, st.st_size);
+            else errno = EISDIR;
+        }
+        if (!script) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+            return errno == ENOENT ? 127 : 126;
+        }
+        close(fd);
+        pos_args = argv + 1;
+        npos_args = argc - 1;
+    }
     
     /* Initialize shell: Set up job control if interactive
      * - Checks if stdin is TTY
@@ -1880,7 +7116,13 @@ int main(void) {
      * - Takes control of terminal
      * - Sets up signal handlers
      */
-    init_shell();
+    init_shell(script != NULL);
+    
+    if (script) {
+        script_run(script);
+        script_put(script);
+        return last_status;
+    }
     
     /* REPL: Infinite loop until EOF or exit command
      * 
@@ -1890,6 +7132,15 @@ int main(void) {
      *   - Shell's signal handlers are installed
      */
     while (1) {
+        /* STEP 0: REPORT JOB STATE CHANGES
+         * 
+         * Reap finished/stopped background jobs and print
+         * "[1] Done ..." here, between commands, never from a signal
+         * handler in the middle of the user's typing.
+         */
+        reap_events(0);
+        notify_jobs(0);
+        
         /* STEP 1: PRINT PROMPT (if interactive)
          * 
          * Interactive: Show prompt to user
@@ -1915,20 +7166,23 @@ int main(void) {
         
         /* STEP 2: READ INPUT LINE
          * 
-         * fgets(buf, size, stream) - library function
+         * read_line(1, NULL) - one logical line, event-loop driven
+         * 
+         * Blocks in epoll_wait() (not read()) until stdin is readable,
+         * reaping jobs and redrawing the prompt meanwhile.
          * 
          * Behavior:
-         *   - Reads up to size-1 characters from stream
-         *   - Stops at newline or EOF
-         *   - Null-terminates the string
-         *   - Includes newline in buffer (if present)
+         *   - Any length: the read-ahead buffer grows to fit
+         *   - "\⏎" joins the next line (secondary prompt "> ")
+         *   - Newline stripped, line NUL-terminated in place
          * 
          * Returns:
-         *   - buf on success
-         *   - NULL on EOF or error
+         *   - Pointer into the read-ahead buffer, valid until the
+         *     next read_line() (the parser copies what it keeps)
+         *   - NULL on EOF
          * 
          * Underlying syscall:
-         *   read(STDIN_FILENO, buffer, count)
+         *   read(STDIN_FILENO, buffer, 64 KiB)
          * 
          * Terminal canonical mode:
          *   - Kernel buffers input until newline
@@ -1936,12 +7190,13 @@ int main(void) {
          *   - read() blocks until user presses Enter
          *   - Kernel returns entire line at once
          */
-        if (!fgets(line, sizeof(line), stdin)) {
+        char *line = read_line(1, NULL);
+        if (!line) {
             /* EOF reached (^D pressed or input closed)
              * 
              * Interactive: User pressed ^D (VEOF character)
              *   - Terminal driver returns 0 bytes to read()
-             *   - fgets() returns NULL
+             *   - read_line() returns NULL
              *   - Shell should exit gracefully
              * 
              * Non-interactive: End of file/pipe
@@ -1953,89 +7208,95 @@ int main(void) {
         }
         printf("TTT");
         
-        /* STEP 3: STRIP NEWLINE
-         * 
-         * strcspn(str, reject) - library function
-         * Returns: Index of first character in str that matches any in reject
-         * 
-         * line[strcspn(line, "\n")] = '\0';
-         * Effect: Replaces newline with null terminator
-         * 
-         * Why?
-         *   - fgets() includes newline in buffer
-         *   - We don't want newline in command arguments
-         *   - Replace it with null terminator
-         */
-        line[strcspn(line, "\n")] = '\0';
-        
         /* Skip empty lines
          * User just pressed Enter without typing anything
          */
         if (line[0] == '\0') continue;
         
-        /* STEP 4: TOKENIZE (Lexical Analysis)
+        /* STEP 3: LEX + PARSE (Lexical and Syntax Analysis)
          * 
-         * Splits input into words (tokens)
+         * Lexing splits input into words and operators: spans over
+         * the text, which stays as it is
          * Handles:
          *   - Whitespace separation
          *   - Quote handling ('single', "double")
          *   - Escape sequences (\)
+         *   - Operators, with or without spaces around them
+         *   - # comments
+         * 
+         * Parsing builds the command tree from them:
+         *   - Lists (; & newline), and-or chains (&& ||)
+         *   - Pipelines (|), negation (!), time
+         *   - Subshells ( ... )
+         *   - Redirections (<, >, >>), assignments (VAR=value)
          * 
          * Example:
-         *   Input:  "ls -la | grep foo"
-         *   Tokens: ["ls", "-la", "|", "grep", "foo"]
+         *   Input:  "make && ls -la|grep 'a b' &"
+         *   Tree:   AND(make, ls -la | grep 'a b'), run in background
+         * 
+         * A command can go on over more lines ("true &&", an open
+         * ( or quote): read them (prompt "> ") and parse the whole
+         * text again. It is copied out of the read-ahead buffer, which
+         * the next read_line() (or a `read` builtin) reuses, and holds
+         * the spans until the commands have run.
          */
-        int ntokens;
-        char **tokens = tokenize(line, &ntokens);
+        static outbuf_t text;
+        static script_t cmdline;
+        text.len = 0;
+        out_add(&text, line, strlen(line));
         
-        /* No tokens (only whitespace) */
-        if (ntokens == 0) continue;
+        int status;
+        for (;;) {
+            cmdline.text = text.data;
+            cmdline.len = text.len;
+            status = parse_commands(&cmdline, 0, 0);
+            if (status != PARSE_MORE) break;
+            
+            if (interactive) {
+                printf("> ");
+                fflush(stdout);
+            }
+            if (!(line = read_line(1, NULL))) {
+                fprintf(stderr, "mysh: syntax error: unexpected end of file\n");
+                break;
+            }
+            out_add(&text, "\n", 1);
+            out_add(&text, line, strlen(line));
+        }
+        if (status != PARSE_OK) {
+            script_clear(&cmdline);
+            last_status = 2;
+            continue;
+        }
         
-        /* STEP 5: PARSE (Syntax Analysis)
+        /* STEP 4: EXECUTE (Evaluation), command line by command line
          * 
-         * Converts tokens into pipeline structure
-         * Handles:
-         *   - Pipes (|)
-         *   - Redirections (<, >, >>)
-         *   - Background (&)
-         *   - Negation (!)
-         *   - Variable assignments (VAR=value)
+         * Core shell operation, per pipeline (run_list()):
+         *   1. Expand words ($VAR, ~, globs)
+         *   2. Fork child processes (one per command in pipeline)
+         *   3. Set up pipes between commands
+         *   4. Set up redirections
+         *   5. Create process group for job
+         *   6. Give terminal to job (if foreground)
+         *   7. exec() each command
+         *   8. Wait for completion (if foreground)
+         *   9. Reclaim terminal
+         *  10. Exit status decides what && || run next
          * 
-         * Example:
-         *   Tokens: ["ls", "-la", "|", "grep", "foo", "&"]
-         *   Pipeline:
-         *     ncmds = 2
-         *     cmds[0] = {args: ["ls", "-la"], argc: 2}
-         *     cmds[1] = {args: ["grep", "foo"], argc: 2}
-         *     background = 1
+         * last_status: exit status of the last pipeline run
+         *   0 = success
+         *   1-255 = failure
+         *   128+N = killed by signal N
+         * 
+         * Saved for $? expansion
+         * User can check: echo $?
+         * Scripts use for error handling: if cmd; then ...; fi
          */
-        pipeline_t pl;
-        if (parse_pipeline(tokens, ntokens, &pl)) {
-            /* STEP 6: EXECUTE (Evaluation)
-             * 
-             * Core shell operation:
-             *   1. Fork child processes (one per command in pipeline)
-             *   2. Set up pipes between commands
-             *   3. Set up redirections
-             *   4. Create process group for job
-             *   5. Give terminal to job (if foreground)
-             *   6. exec() each command
-             *   7. Wait for completion (if foreground)
-             *   8. Reclaim terminal
-             *   9. Return exit status
-             * 
-             * Returns: Exit status of last command in pipeline
-             *   0 = success
-             *   1-255 = failure
-             *   128+N = killed by signal N
-             */
-            last_status = execute_pipeline(&pl);
-            
-            /* last_status saved for $? expansion
-             * User can check: echo $?
-             * Scripts use for error handling: if cmd; then ...; fi
-             */
+        for (int i = 0; i < cmdline.ncmds; i++) {
+            if (i > 0) reap_events(0);
+            run_list(cmdline.cmds[i]);
         }
+        script_clear(&cmdline);
         
         /* LOOP BACK TO TOP
          * 
@@ -2098,3 +7359,192 @@ int main(void) {
      */
     return last_status;
 }
+#endif /* !LEX_BENCH && !SOAK_TEST */
+
+#ifdef LEX_BENCH
+/*
+ * LEXER MICROBENCHMARK - make bench-lex
+ * 
+ *   ./lex-bench [MIN_MBPS [FILE]]
+ * 
+ * Lexes FILE, or 64 MiB of generated script (plain and quoted words,
+ * escapes, operators, comments), line by line as the parser does, for
+ * about a second. Prints MB/s and tokens/s; exits 1 below MIN_MBPS,
+ * so the Makefile can use it as a regression gate.
+ */
+static const char *lex_bench_lines[] = {
+    "ls -la /usr/lib/x86_64-linux-gnu | grep -v \"\\.so\\.[0-9]\" > /tmp/libs.txt",
+    "FOO='single quoted value' BAR=\"double $HOME/x\" cmd --flag=value arg\\ with\\ escapes",
+    "make -j8 CFLAGS=\"-O2 -g\" && ./run --input data/in.csv || echo failed; cd ..",
+    "(cd /var/log && tail -n 100 syslog) | awk '{ print $5 }' | sort | uniq -c >> counts",
+    "rsync -av --exclude='*.tmp' /srv/data/p000123/file.dat /srv/data/p000124/ backup:/srv/",
+    "gcc -c \"$f\" -o \"${f%.c}.o\" & wait  # build objects in the background",
+};
+
+static double lex_bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    double min_mbps = argc > 1 ? atof(argv[1]) : 0;
+    outbuf_t text = { NULL, 0, 0 };
+    
+    if (argc > 2) {
+        int fd = open(argv[2], O_RDONLY);
+        char buf[65536];
+        ssize_t n;
+        if (fd < 0) {
+            perror(argv[2]);
+            return 2;
+        }
+        while ((n = read(fd, buf, sizeof(buf))) > 0) out_add(&text, buf, n);
+        close(fd);
+    } else {
+        size_t nlines = sizeof(lex_bench_lines) / sizeof(lex_bench_lines[0]);
+        for (size_t i = 0; text.len < 64 << 20; i++) {
+            const char *l = lex_bench_lines[i % nlines];
+            out_add(&text, l, strlen(l));
+            out_add(&text, "\n", 1);
+        }
+    }
+    
+    token_vec_t tv = { NULL, 0, 0 };
+    unsigned long long tokens = 0, bytes = 0;
+    double start = lex_bench_now(), elapsed;
+    do {
+        for (size_t pos = 0; pos < text.len; ) {
+            if (lex(text.data, &pos, text.len, &tv) == 0) tokens += tv.n;
+        }
+        bytes += text.len;
+        elapsed = lex_bench_now() - start;
+    } while (elapsed < 1.0);
+    
+    double mbps = bytes / elapsed / 1e6;
+    printf("lex: %.0f MB/s, %.1f M tokens/s (%.1f MB in %.2f s)\n",
+           mbps, tokens / elapsed / 1e6, bytes / 1e6, elapsed);
+    if (mbps < min_mbps) {
+        fprintf(stderr, "lex: below the %.0f MB/s floor\n", min_mbps);
+        return 1;
+    }
+    return 0;
+}
+#endif /* LEX_BENCH */
+
+#ifdef SOAK_TEST
+/*
+ * MEMORY SOAK TEST - make soak
+ * 
+ *   ./soak-test [COMMANDS [MAX_MALLOCS]]
+ * 
+ * Runs COMMANDS command lines (default 10M) the way the REPL does -
+ * parse into the line's arena, run, clear - cycling through
+ * soak_lines: assignments, every kind of expansion, && || ! chains,
+ * a redirected builtin. All builtins, so nothing forks: the loop
+ * measures the shell alone.
+ * 
+ * After a warm-up (the first 1%, while buffers and arenas grow to
+ * their size) it checks, and exits 1 if either fails:
+ *   RSS         anonymous memory grows by less than SOAK_RSS_SLACK
+ *               over the rest
+ *   malloc()s   MAX_MALLOCS per command at most, on average
+ * 
+ * malloc/calloc/realloc are replaced in this build by counters in
+ * front of glibc's __libc_* entry points; glibc's own callers
+ * (strdup(), glob(), stdio) come through them too.
+ */
+#define SOAK_RSS_SLACK (256 * 1024)
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+
+static unsigned long long soak_mallocs;
+
+void *malloc(size_t n) {
+    soak_mallocs++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    soak_mallocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    soak_mallocs++;
+    return __libc_realloc(p, n);
+}
+
+static const char *soak_lines[] = {
+    "X=v$?; : $X ~ \"a b\" 'c' d\\ e",
+    "true && false || : done",
+    "echo hi > /dev/null",
+    "test -n \"$HOME\" && Y=${X}z",
+    "! false; : $Y $0 $# \"$@\"",
+    "PAIR=$X$Y; [ \"$PAIR\" = v0v0z ] || echo \"$PAIR\" >> /dev/null",
+};
+
+/*
+ * Resident anonymous bytes (heap, stack, arenas) from /proc/self/statm:
+ * resident - shared. File pages (this binary, libc) fault in as code
+ * paths first run, which is not growth. No stdio: it would malloc.
+ */
+static size_t soak_rss(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    unsigned long size, resident = 0, shared = 0;
+    if (fd >= 0) close(fd);
+    if (n > 0) {
+        buf[n] = '\0';
+        sscanf(buf, "%lu %lu %lu", &size, &resident, &shared);
+    }
+    return (resident - shared) * sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char **argv) {
+    unsigned long long ncmds = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    double max_mallocs = argc > 2 ? atof(argv[2]) : 1;
+    unsigned long long warmup = ncmds / 100;
+    size_t nlines = sizeof(soak_lines) / sizeof(soak_lines[0]);
+    static script_t cmdline;
+    size_t rss0 = 0;
+    unsigned long long mallocs0 = 0;
+    
+    pos_args = argv;
+    npos_args = 1;
+    init_shell(1);
+    
+    for (unsigned long long i = 0; i < ncmds; i++) {
+        if (i == warmup) {
+            rss0 = soak_rss();
+            mallocs0 = soak_mallocs;
+        }
+        cmdline.text = (char *)soak_lines[i % nlines];
+        cmdline.len = strlen(cmdline.text);
+        if (parse_commands(&cmdline, 0, 0) == PARSE_OK) {
+            for (int j = 0; j < cmdline.ncmds; j++) run_list(cmdline.cmds[j]);
+        }
+        script_clear(&cmdline);
+    }
+    
+    size_t rss1 = soak_rss();
+    double per_cmd = ncmds > warmup ?
+                     (double)(soak_mallocs - mallocs0) / (ncmds - warmup) : 0;
+    printf("soak: %llu commands, RSS %zu KiB after warm-up, %zu KiB at the end, "
+           "%.3f malloc()s per command\n", ncmds, rss0 / 1024, rss1 / 1024, per_cmd);
+    
+    int failed = 0;
+    if (rss1 > rss0 + SOAK_RSS_SLACK) {
+        fprintf(stderr, "soak: RSS grew by %zu KiB\n", (rss1 - rss0) / 1024);
+        failed = 1;
+    }
+    if (per_cmd > max_mallocs) {
+        fprintf(stderr, "soak: more than %.2f malloc()s per command\n", max_mallocs);
+        failed = 1;
+    }
+    return failed;
+}
+#endif /* SOAK_TEST */
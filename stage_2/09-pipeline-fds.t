@@ -0,0 +1,9 @@
+# Every stage of a pipeline should see only its own ends of the pipes,
+# however long the pipeline is.
+→ echo foo | list-fds | cat⏎
+↵ 0\n1\n2
+→ true | true | true | true | true | true | true | true | true | true | true | true | true | true | list-fds | cat⏎
+↵ 0\n1\n2
+# a builtin in the middle of a pipeline must not hold the pipes open
+→ list-fds | cd /tmp | cat | list-fds⏎
+↵ 0\n1\n2
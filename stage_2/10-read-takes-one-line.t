@@ -0,0 +1,20 @@
+# read takes one line; the rest of the input is left to whoever reads next
+→ echo one > lines; echo two >> lines; echo three >> lines⏎
+→ (read a; read b; echo-rot13 $a $b; cat) < lines⏎
+↵ bar gjb\nthree
+→ cat lines | (read a; cat)⏎
+↵ two\nthree
+# fields are split on IFS; the last name gets the rest of the line
+→ echo 'a b  c' | (read x y; echo-rot13 "[$x]" "[$y]")⏎
+↵ [n] [o  p]
+# without -r a backslash quotes the next character
+→ echo 'a\ b c' | (read x y; echo-rot13 "[$x]")⏎
+↵ [n o]
+→ echo 'a\ b c' | (read -r x y; echo-rot13 "[$x]")⏎
+↵ [n\]
+# at end of file read fails, but the partial line is still assigned
+→ echo -n last > partial; read z < partial || echo-rot13 eof $z⏎
+↵ rbs ynfg
+# a redirected read in a -c shell must leave the shell's stdin alone
+→ /proc/$$/exe -c 'read x < lines; read y; echo-rot13 $x $y; cat' < lines⏎
+↵ bar bar\ntwo\nthree
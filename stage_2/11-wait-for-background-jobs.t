@@ -0,0 +1,17 @@
+# wait PID and wait %job give that job's exit status
+→ (exit 3) &⏎
+→ wait $!; echo-rot13 status $?⏎
+↵ fgnghf 3
+→ (sleep 0.1; exit 4) & wait %%; echo-rot13 status $?⏎
+↵ fgnghf 4
+# no operands: wait for every background job
+→ (sleep 0.4; echo one > a) & (sleep 0.2; echo two > b) & wait; cat a b⏎
+↵ one\ntwo
+# wait -n: whichever job finishes first
+→ (sleep 0.6; exit 5) & (sleep 0.2; exit 6) & wait -n; echo-rot13 first $?⏎
+↵ svefg 6
+→ wait -n; echo-rot13 second $?⏎
+↵ frpbaq 5
+# not a child of this shell
+→ wait 99999999; echo-rot13 status $?⏎
+↵ fgnghf 127
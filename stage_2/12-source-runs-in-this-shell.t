@@ -0,0 +1,17 @@
+# . and source run a file in this shell: its assignments stay in effect
+→ echo 'X=zim; Y=$X$X' > lib.sh⏎
+→ . ./lib.sh; echo-rot13 $Y⏎
+↵ mvzmvz
+→ X=; source ./lib.sh; source ./lib.sh; echo-rot13 $X⏎
+↵ mvz
+# an edited file is read again
+→ echo 'X=foo; echo-rot13 $X' > lib.sh; source ./lib.sh⏎
+↵ sbb
+# the status is that of the file's last command
+→ echo false > f.sh; . ./f.sh; echo-rot13 status $?⏎
+↵ fgnghf 1
+# a name without / is looked up in PATH, then in the current directory
+→ echo 'echo-rot13 found' > here.sh; . here.sh⏎
+↵ sbhaq
+→ . ./nonexistent.sh || echo-rot13 failed⏎
+↵ snvyrq
@@ -0,0 +1,41 @@
+# quotes are removed, and ' and " don't end each other
+→ echo-argc 'a "b" c' "d 'e' f"⏎
+↵ 2
+→ echo "it's" 'say "hi"'⏎
+↵ it's say "hi"
+# quoted and unquoted parts next to each other make one word
+→ echo-argc a'b c'"d e"f⏎
+↵ 1
+→ echo a'b c'"d e"f⏎
+↵ ab cd ef
+# a backslash quotes the next character; inside "..." only before $ ` " \
+→ echo \\ a\ b \'c\' \"d\"⏎
+↵ \ a b 'c' "d"
+→ echo "a\$b \"c\" \\ \x" 'a\$b'⏎
+↵ a$b "c" \ \x a\$b
+# $VAR expands outside and inside "...", not inside '...'
+→ X=zim; Y='a  b'⏎
+→ echo-rot13 $X "$X" '$X' x${X}x⏎
+↵ mvz mvz $K kmvzk
+→ echo-argc "$Y"; echo-argc '$Y'⏎
+↵ 1\n1
+→ echo "<$Y>" '<$Y>'⏎
+↵ <a  b> <$Y>
+# operators need no blanks around them; quoted, they are plain text
+→ echo-rot13 a|tr n b;echo-rot13 c&&echo-rot13 d⏎
+↵ b\np\nq
+→ echo 'a|b' "c;d" e\&\&f⏎
+↵ a|b c;d e&&f
+# an open quote continues on the next line
+→ echo-rot13 'zim⏎
+→ zam'⏎
+↵ mvz\nmnz
+# syntax errors: reported, and nothing on the line runs
+→ echo-rot13 foo | | cat⏎
+≠ sbb
+→ ; echo-rot13 foo⏎
+≠ sbb
+→ echo-rot13 foo )⏎
+≠ sbb
+→ echo-rot13 ok⏎
+↵ bx
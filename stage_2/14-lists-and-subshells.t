@@ -0,0 +1,32 @@
+# ; runs each command in turn, whatever its status
+→ false; echo-rot13 a; true; echo-rot13 b⏎
+↵ n\no
+# && and || bind equally tightly, left to right
+→ false && echo-rot13 no || echo-rot13 yes⏎
+↵ lrf
+→ true || echo-rot13 no && echo-rot13 yes⏎
+↵ lrf
+→ false && echo-rot13 one || false && echo-rot13 two || echo-rot13 three⏎
+↵ guerr
+# a subshell is a child: cd and assignments stay inside it
+→ cd /tmp; (cd /; X=inner; pwd); pwd; echo-rot13 "[$X]"⏎
+↵ /\n/tmp\n[]
+# its status is its last command's; it can be piped and redirected
+→ (false; true) && echo-rot13 ok⏎
+↵ bx
+→ (echo-rot13 a; echo-rot13 b) | tr a-z A-Z⏎
+↵ N\nO
+→ (echo-rot13 x; echo-rot13 y) > out; cat out⏎
+↵ k\nl
+# & puts the whole and-or list before it in the background
+→ false && echo-rot13 no || (sleep 0.2; echo-rot13 bg) & echo-rot13 fg; wait⏎
+↵ st\not
+# ! negates the status of the pipeline it starts
+→ ! false && echo-rot13 a⏎
+↵ n
+→ ! true || echo-rot13 b⏎
+↵ o
+→ ! (exit 3); echo-rot13 status $?⏎
+↵ fgnghf 0
+→ ! echo-rot13 zim | grep -q mvz || echo-rot13 negated⏎
+↵ artngrq
@@ -0,0 +1,8 @@
+# a redirection that fails is not a missing command: wc stays hashed
+→ wc -c < /etc/hostname > /dev/null; wc -c < nonexistent-file⏎
+→ hash | grep -c /wc⏎
+↵ 1
+→ wc -c < nonexistent-file || echo-rot13 failed⏎
+↵ snvyrq
+→ hash | grep -c /wc⏎
+↵ 1